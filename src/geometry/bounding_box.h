@@ -78,21 +78,21 @@ class bounding_box {
     }
 
     double hit(const ray& r) const {
-        double t1 = (min[0] - r.origin()[0]) * r.dir_inv[0];
-        double t2 = (max[0] - r.origin()[0]) * r.dir_inv[0];
-
-        double tmin = std::min(t1, t2);
-        double tmax = std::max(t1, t2);
-
+        // Distances to all three pairs of slabs at once, the padding lane is ignored
+        vec3::lanes t1 = (min.e - r.origin().e) * r.dir_inv.e;
+        vec3::lanes t2 = (max.e - r.origin().e) * r.dir_inv.e;
+        vec3::lanes near = t2 < t1 ? t2 : t1;
+        vec3::lanes far = t1 < t2 ? t2 : t1;
+
+        double tmin = near[0];
+        double tmax = far[0];
         for (int i = 1; i < 3; ++i) {
-            t1 = (min[i] - r.origin()[i]) * r.dir_inv[i];
-            t2 = (max[i] - r.origin()[i]) * r.dir_inv[i];
-
-            tmin = std::max(tmin, std::min(std::min(t1, t2), tmax));
-            tmax = std::min(tmax, std::max(std::max(t1, t2), tmin));
+            tmin = std::max(tmin, std::min(near[i], tmax));
+            tmax = std::min(tmax, std::max(far[i], tmin));
         }
 
-        return tmax > std::max(tmin, 0.0) && tmax > 0 ? tmin : -1;
+        // Rays that start inside the box enter it at 0
+        return tmax > std::max(tmin, 0.0) && tmax > 0 ? std::max(tmin, 0.0) : -1;
     }
 
     void calc_points() {
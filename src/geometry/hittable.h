@@ -1,28 +1,179 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include <cstring>
+#include <vector>
+
+#include "../util/lanes.h"
 #include "../util/utils.h"
 #include "bounding_box.h"
 
 class material;
+class triangle;
+class hittable;
 
 class hit_record {
    public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    vec3 incoming;  // Direction of the ray that hit, not normalized
+    const material* mat = nullptr;  // Kept alive by MATERIALS or the object that was hit
     double t;
     bool front_face;
     double u, v;  // UV coordinates for texture mapping
+    const hittable* object = nullptr;  // Primitive that was hit
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector
         // NOTE: the parameter `outward_nromal` is assumed to have unit length
+        incoming = r.direction();
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
 };
 
+// Up to 64 rays with similar origins and directions, like the camera rays of a small block of
+// pixels, traced through the scene together. Each ray keeps its own closest hit.
+struct ray_packet {
+    static constexpr int MAX_RAYS = 64;  // An 8x8 block, one bit each in a uint64_t of active rays
+    static const int MAX_GROUPS = (MAX_RAYS + LANE_WIDTH - 1) / LANE_WIDTH;
+
+    int count = 0;
+    double t_min = 0.001;
+    ray rays[MAX_RAYS];
+    alignas(64) double closest[MAX_RAYS];  // Distance of each ray's closest hit so far, or where the ray ends
+    bool hit[MAX_RAYS];
+    hit_record records[MAX_RAYS];
+
+    rayxN groups[MAX_GROUPS];  // The rays packed LANE_WIDTH at a time, the last group padded
+    int group_count = 0;
+
+    // Whether every ray points the same way along each axis, in which case the whole packet can be
+    // culled against a box with interval arithmetic on the bounds below
+    bool coherent = false;
+    vec3 origin_min, origin_max;
+    vec3 dir_inv_min, dir_inv_max;
+    vec3 direction_sum;  // Sum of the directions, used to order children front to back
+
+    void clear() { count = 0; }
+
+    void add(const ray& r, double t_max = infinity) {
+        rays[count] = r;
+        closest[count] = t_max;
+        hit[count] = false;
+        count++;
+    }
+
+    uint64_t all_rays() const { return count == MAX_RAYS ? ~uint64_t(0) : (uint64_t(1) << count) - 1; }
+
+    // Fills in the lane groups and packet bounds once all rays are added
+    void prepare() {
+        group_count = (count + LANE_WIDTH - 1) / LANE_WIDTH;
+        for (int i = 0; i < group_count * LANE_WIDTH; i++)
+            groups[i / LANE_WIDTH].set(i % LANE_WIDTH, rays[std::min(i, count - 1)]);
+
+        coherent = count > 0;
+        origin_min = origin_max = rays[0].origin();
+        dir_inv_min = dir_inv_max = rays[0].dir_inv;
+        direction_sum = vec3();
+        for (int i = 0; i < count; i++) {
+            origin_min = vec_min(origin_min, rays[i].origin());
+            origin_max = vec_max(origin_max, rays[i].origin());
+            dir_inv_min = vec_min(dir_inv_min, rays[i].dir_inv);
+            dir_inv_max = vec_max(dir_inv_max, rays[i].dir_inv);
+            direction_sum += rays[i].direction();
+        }
+        for (int axis = 0; axis < 3; axis++)
+            if (!(dir_inv_min[axis] > 0 || dir_inv_max[axis] < 0) || !std::isfinite(dir_inv_min[axis] * dir_inv_max[axis]))
+                coherent = false;
+    }
+
+    // Rays of group g that are in active, as a lane mask
+    maskxN group_mask(uint64_t active, int g) const {
+        return maskxN::from_bits(uint32_t(active >> (g * LANE_WIDTH)) & ((1u << LANE_WIDTH) - 1));
+    }
+
+    realxN group_closest(int g) const {
+        realxN result;
+        std::memcpy(&result, &closest[g * LANE_WIDTH], sizeof(result));
+        return result;
+    }
+
+    // False if no ray of the packet can enter bounds before its closest hit. Bounds the slab
+    // distances of all rays at once with interval arithmetic, so it only works for coherent packets.
+    bool may_hit(const bounding_box& bounds, uint64_t active) const {
+        if (!coherent)
+            return true;
+
+        double farthest = 0;
+        for (int i = 0; i < count; i++)
+            if ((active >> i) & 1)
+                farthest = std::fmax(farthest, closest[i]);
+
+        double entry = t_min;
+        double exit = farthest;
+        for (int axis = 0; axis < 3; axis++) {
+            // Rays going the negative way enter through the max side
+            bool positive = dir_inv_min[axis] > 0;
+            double near_plane = positive ? bounds.min[axis] : bounds.max[axis];
+            double far_plane = positive ? bounds.max[axis] : bounds.min[axis];
+
+            // Smallest entry and largest exit distance any ray of the packet can have
+            entry = std::fmax(entry, interval_product_min(near_plane - origin_max[axis], near_plane - origin_min[axis], axis));
+            exit = std::fmin(exit, interval_product_max(far_plane - origin_max[axis], far_plane - origin_min[axis], axis));
+        }
+        return entry <= exit;
+    }
+
+    // Active rays that enter bounds before their closest hit, slab tested LANE_WIDTH at a time
+    uint64_t hit_box(const bounding_box& bounds, uint64_t active) const {
+        vec3xN box_min(bounds.min);
+        vec3xN box_max(bounds.max);
+        uint64_t result = 0;
+        for (int g = int(__builtin_ctzll(active)) / LANE_WIDTH; g < group_count; g++) {
+            maskxN lanes = group_mask(active, g);
+            if (lanes.none())
+                continue;
+
+            // Same steps as bounding_box::hit, so packets find exactly what single rays do
+            const rayxN& r = groups[g];
+            vec3xN t1 = (box_min - r.origin) * r.dir_inv;
+            vec3xN t2 = (box_max - r.origin) * r.dir_inv;
+            vec3xN near = lane_min(t1, t2);
+            vec3xN far = lane_max(t1, t2);
+
+            realxN tmin = near.x;
+            realxN tmax = far.x;
+            tmin = lane_max(tmin, lane_min(near.y, tmax));
+            tmax = lane_min(tmax, lane_max(far.y, tmin));
+            tmin = lane_max(tmin, lane_min(near.z, tmax));
+            tmax = lane_min(tmax, lane_max(far.z, tmin));
+
+            realxN entry = lane_max(tmin, broadcast<LANE_WIDTH>(0.0));
+            uint32_t hits = (lanes & maskxN(tmax > entry) & maskxN(entry <= group_closest(g))).bits();
+            result |= uint64_t(hits) << (g * LANE_WIDTH);
+        }
+        return result;
+    }
+
+    // Records a hit for ray i found by a single ray test
+    void record(int i, const hit_record& rec) {
+        records[i] = rec;
+        closest[i] = rec.t;
+        hit[i] = true;
+    }
+
+   private:
+    // Bounds of (plane - origin) * dir_inv over the packet, for plane - origin in [lo, hi]
+    double interval_product_min(double lo, double hi, int axis) const {
+        return std::fmin(std::fmin(lo * dir_inv_min[axis], lo * dir_inv_max[axis]), std::fmin(hi * dir_inv_min[axis], hi * dir_inv_max[axis]));
+    }
+
+    double interval_product_max(double lo, double hi, int axis) const {
+        return std::fmax(std::fmax(lo * dir_inv_min[axis], lo * dir_inv_max[axis]), std::fmax(hi * dir_inv_min[axis], hi * dir_inv_max[axis]));
+    }
+};
+
 class hittable {
    public:
     virtual ~hittable() = default;
@@ -30,6 +181,26 @@ class hittable {
     virtual bounding_box get_bounds() const = 0;
     virtual void move_origin(const vec3& offset) = 0;
 
+    // Intersects the rays of packet in the active mask, keeping each ray's closest hit. Shapes
+    // without a packet test trace the rays one at a time.
+    virtual void hit_packet(ray_packet& packet, uint64_t active) const {
+        for (int i = 0; i < packet.count; i++) {
+            hit_record rec;
+            if ((active >> i) & 1 && hit(packet.rays[i], interval(packet.t_min, packet.closest[i]), rec))
+                packet.record(i, rec);
+        }
+    }
+
+    // Adds every triangle with an emissive material to emitters
+    virtual void collect_emitters(std::vector<const triangle*>& /*emitters*/) const {}
+
+    // Adds the bounds of every primitive with a specular material to bounds
+    virtual void collect_specular_bounds(std::vector<bounding_box>& /*bounds*/) const {}
+
+    // Gives each of node_count NUMA nodes its own copy of any acceleration structure, for threads
+    // pinned to that node to traverse. Shapes without one have nothing to copy.
+    virtual void replicate_for_numa(int /*node_count*/) const {}
+
     point3 origin;
 };
 
@@ -36,6 +36,11 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    void hit_packet(ray_packet& packet, uint64_t active) const override {
+        for (const auto& object : objects)
+            object->hit_packet(packet, active);
+    }
+
     bounding_box get_bounds() const override {
         if (objects.empty()) {
             std::cerr << "No objects in hittable_list\n";
@@ -53,6 +58,21 @@ class hittable_list : public hittable {
         for (auto& object : objects)
             object->move_origin(offset);
     }
+
+    void collect_emitters(std::vector<const triangle*>& emitters) const override {
+        for (const auto& object : objects)
+            object->collect_emitters(emitters);
+    }
+
+    void collect_specular_bounds(std::vector<bounding_box>& bounds) const override {
+        for (const auto& object : objects)
+            object->collect_specular_bounds(bounds);
+    }
+
+    void replicate_for_numa(int node_count) const override {
+        for (const auto& object : objects)
+            object->replicate_for_numa(node_count);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <vector>
 
 #include "../scene/material.h"
+#include "../util/cpu_topology.h"
+#include "../util/thread_pool.h"
 #include "../util/utils.h"
 #include "hittable.h"
 #include "node.h"
@@ -24,7 +26,11 @@ class mesh : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        return bvh.hit(r, ray_t, rec);
+        return local_bvh().hit(r, ray_t, rec);
+    }
+
+    void hit_packet(ray_packet& packet, uint64_t active) const override {
+        local_bvh().hit_packet(packet, active);
     }
 
     bounding_box get_bounds() const override {
@@ -43,10 +49,30 @@ class mesh : public hittable {
         point3 offset = origin - oldPos;
 
         bvh.move_origin(offset);
+        replicas.clear();
     }
 
     void move_origin(const vec3& offset) override {
         bvh.move_origin(offset);
+        replicas.clear();
+    }
+
+    void collect_emitters(std::vector<const triangle*>& emitters) const override {
+        for (const auto& tri : tris)
+            tri->collect_emitters(emitters);
+    }
+
+    void collect_specular_bounds(std::vector<bounding_box>& bounds) const override {
+        for (const auto& tri : tris)
+            tri->collect_specular_bounds(bounds);
+    }
+
+    // Each copy is made by a thread pinned to its node, so its pages are allocated there
+    void replicate_for_numa(int node_count) const override {
+        replicas.clear();
+        replicas.resize(node_count);
+        for (int n = 0; n < node_count; n++)
+            run_on_numa_node(n, [&] { replicas[n] = bvh.clone(); });
     }
 
     void set_material(std::string name) {
@@ -61,9 +87,10 @@ class mesh : public hittable {
     }
 
     void scale(const vec3& v) {
-        for (auto& tri : tris) {
-            tri->scale(origin, v);
-        }
+        shared_thread_pool().parallel_for(0, int(tris.size()), TRIS_PER_JOB, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                tris[i]->scale(origin, v);
+        });
 
         calculate_bvh();
     }
@@ -71,19 +98,35 @@ class mesh : public hittable {
     void rotate(double angle, const vec3& axis) {
         if (angle <= 0) return;
 
-        for (auto& tri : tris) {
-            tri->rotate(angle, origin, axis);
-        }
+        shared_thread_pool().parallel_for(0, int(tris.size()), TRIS_PER_JOB, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                tris[i]->rotate(angle, origin, axis);
+        });
 
         calculate_bvh();
     }
 
    private:
+    static const int TRIS_PER_JOB = 1024;  // Triangles each pool job transforms
+
     // shared_ptr<material> mat;
     std::string mat_name = "missing_texture";  // Default material name
 
+    // Copies of bvh per NUMA node, empty unless replicate_for_numa was called since the mesh last
+    // changed. Built before a render starts, read only during it.
+    mutable std::vector<std::unique_ptr<node>> replicas;
+
+    // The calling thread's node's copy of the hierarchy, or the original if it has none
+    const node& local_bvh() const {
+        int numa_node = current_numa_node();
+        if (numa_node >= 0 && numa_node < int(replicas.size()) && replicas[numa_node])
+            return *replicas[numa_node];
+        return bvh;
+    }
+
     void calculate_bvh() {
         bvh = node(tris, 0);
+        replicas.clear();
     }
 };
 
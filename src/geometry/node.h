@@ -1,15 +1,72 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include <array>
 #include <climits>
 #include <memory>
 #include <vector>
 
+#include "../util/stats.h"
+#include "../util/thread_pool.h"
 #include "../util/utils.h"
 #include "bounding_box.h"
 #include "hittable_list.h"
 #include "tri.h"
 
+// Lists at least this long are counted and split on the shared pool, shorter ones on the calling
+// thread. Below it the pool's overhead outweighs the work.
+const int PARALLEL_BUILD_MIN = 4096;
+
+// Tries the midpoint of the bounds on every axis and returns the one that splits the items most
+// evenly by origin, or -1 if no axis puts items on both sides. Shared by every hierarchy we build.
+template <typename T, typename OriginFn>
+int choose_split_axis(const bounding_box& bounds, const std::vector<T>& items, OriginFn origin_of) {
+    vec3 splitPoint = 0.5 * (bounds.min + bounds.max);
+
+    // Items left of the midpoint on each axis, counted in one pass over the items
+    auto count_left = [&](int first, int last) {
+        std::array<int, 3> counts = {0, 0, 0};
+        for (int j = first; j < last; j++) {
+            point3 origin = origin_of(items[j]);
+            for (int i = 0; i < 3; i++)
+                if (origin[i] < splitPoint[i])
+                    counts[i]++;
+        }
+        return counts;
+    };
+
+    int itemCount = int(items.size());
+    std::array<int, 3> leftCounts;
+    if (itemCount >= PARALLEL_BUILD_MIN) {
+        auto add = [](std::array<int, 3> a, const std::array<int, 3>& b) {
+            for (int i = 0; i < 3; i++)
+                a[i] += b[i];
+            return a;
+        };
+        leftCounts = shared_thread_pool().parallel_reduce(0, itemCount, PARALLEL_BUILD_MIN / 4, std::array<int, 3>{0, 0, 0}, count_left, add);
+    } else {
+        leftCounts = count_left(0, itemCount);
+    }
+
+    // Try all axis
+    int bestAxis = -1;
+    int difference = INT_MAX;
+    for (int i = 0; i < 3; i++) {
+        int leftCount = leftCounts[i];
+        int rightCount = itemCount - leftCount;
+
+        if (leftCount > 0 && rightCount > 0) {
+            int diff = std::abs(leftCount - rightCount);
+            if (diff < difference) {
+                difference = diff;
+                bestAxis = i;
+            }
+        }
+    }
+
+    return bestAxis;
+}
+
 class node {
    public:
     node(const std::vector<shared_ptr<triangle>>& tris, int splitDepth) : bounds(), children(), splitDepth(splitDepth) {
@@ -30,6 +87,9 @@ class node {
     std::unique_ptr<node> childB;
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_node(this);
+
         double dist = bounds.hit(r);
         if (dist < 0 || ray_t.max < dist)
             return false;
@@ -38,18 +98,18 @@ class node {
             double distA = childA->bounds.hit(r);
             double distB = childB->bounds.hit(r);
 
-            const node* near = distA < distB ? childA.get() : childB.get();
-            const node* far = distA < distB ? childB.get() : childA.get();
+            // Visit the closer child first, children the ray misses report -1
+            bool aFirst = distB < 0 || (distA >= 0 && distA < distB);
+            const node* near = aFirst ? childA.get() : childB.get();
+            const node* far = aFirst ? childB.get() : childA.get();
+            double farDist = aFirst ? distB : distA;
 
-            bool hit_near = false;
-            double closest_so_far = ray_t.max;
-            if (near->hit(r, ray_t, rec)) {
-                hit_near = true;
-                closest_so_far = rec.t;
-            }
+            bool hit_near = near->hit(r, ray_t, rec);
+            double closest_so_far = hit_near ? rec.t : ray_t.max;
 
-            if (closest_so_far < distB)
-                return true;
+            // The far child can't hold anything closer than what we already hit
+            if (farDist < 0 || closest_so_far < farDist)
+                return hit_near;
 
             if (far->hit(r, interval(ray_t.min, closest_so_far), rec))
                 return true;
@@ -63,6 +123,41 @@ class node {
         return false;
     }
 
+    // Packet version of hit. Culls the whole packet against each node's bounds, then drops the
+    // leading rays that miss them. Once fewer than a quarter of the packet's rays are left, the
+    // survivors finish the subtree as single rays, as the packet no longer saves them any work.
+    void hit_packet(ray_packet& packet, uint64_t active) const {
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_node(this);
+
+        if (!packet.may_hit(bounds, active))
+            return;
+
+        active = packet.hit_box(bounds, active);
+        if (!active)
+            return;
+
+        if (4 * __builtin_popcountll(active) < packet.count) {
+            for (int i = 0; i < packet.count; i++) {
+                hit_record rec;
+                if ((active >> i) & 1 && hit(packet.rays[i], interval(packet.t_min, packet.closest[i]), rec))
+                    packet.record(i, rec);
+            }
+            return;
+        }
+
+        if (childA && childB) {
+            // Visit the child the packet reaches first first, so the other can be culled by the hits
+            vec3 between = (childB->bounds.min + childB->bounds.max) - (childA->bounds.min + childA->bounds.max);
+            bool aFirst = dot(between, packet.direction_sum) >= 0;
+            (aFirst ? childA : childB)->hit_packet(packet, active);
+            (aFirst ? childB : childA)->hit_packet(packet, active);
+            return;
+        }
+
+        children.hit_packet(packet, active);
+    }
+
     void move_origin(const vec3& offset) {
         bounds.offset(offset);
 
@@ -73,6 +168,18 @@ class node {
             children.move_origin(offset);
     }
 
+    // Copy of the hierarchy in memory first touched by the calling thread. The leaves point at
+    // the same primitives, so hits still report the objects the light tree knows.
+    std::unique_ptr<node> clone() const {
+        std::unique_ptr<node> copy(new node());
+        copy->bounds = bounds;
+        copy->children = children;
+        copy->splitDepth = splitDepth;
+        if (childA) copy->childA = childA->clone();
+        if (childB) copy->childB = childB->clone();
+        return copy;
+    }
+
     int get_largest_bvh() const {
         if (childA && childB)
             return std::max(childA->get_largest_bvh(), childB->get_largest_bvh());
@@ -84,6 +191,8 @@ class node {
     static const int MAX_SPLIT_DEPTH = 32;
     int splitDepth = 0;
 
+    node() {}  // Unbuilt, for clone to fill in
+
     void init() {
         // Make sure the bounds are not a plane
         if (bounds.min.x() == bounds.max.x())
@@ -102,28 +211,9 @@ class node {
     }
 
     void split() {
-        // Try all axis
-        int longestAxis = -1;
-        int difference = INT_MAX;
-        for (int i = 0; i < 3; i++) {
-            double splitPoint = (bounds.min[i] + bounds.max[i]) / 2;
-            int leftCount = 0;
-            int rightCount = 0;
-
-            for (const auto& object : children.objects)
-                if (object->origin[i] < splitPoint)
-                    leftCount++;
-                else
-                    rightCount++;
-
-            if (leftCount > 0 && rightCount > 0) {
-                int diff = std::abs(leftCount - rightCount);
-                if (diff < difference) {
-                    difference = diff;
-                    longestAxis = i;
-                }
-            }
-        }
+        int longestAxis = choose_split_axis(bounds, children.objects, [](const shared_ptr<hittable>& object) {
+            return object->origin;
+        });
 
         if (longestAxis == -1) {
             return;
@@ -142,8 +232,16 @@ class node {
         if (aList.objects.size() == 0 || bList.objects.size() == 0)
             return;
 
-        childA = std::make_unique<node>(aList, splitDepth + 1);
-        childB = std::make_unique<node>(bList, splitDepth + 1);
+        // The two halves are independent, so big ones are built side by side
+        if (int(children.objects.size()) >= PARALLEL_BUILD_MIN) {
+            shared_thread_pool().parallel_for(0, 2, 1, [&](int first, int last) {
+                for (int c = first; c < last; c++)
+                    (c == 0 ? childA : childB) = std::make_unique<node>(c == 0 ? aList : bList, splitDepth + 1);
+            });
+        } else {
+            childA = std::make_unique<node>(aList, splitDepth + 1);
+            childB = std::make_unique<node>(bList, splitDepth + 1);
+        }
     }
 };
 
@@ -1,6 +1,7 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
+#include "../scene/material.h"
 #include "../util/utils.h"
 #include "hittable.h"
 
@@ -35,7 +36,8 @@ class sphere : public hittable {
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - origin) / radius;
         rec.set_face_normal(r, outward_normal);
-        rec.mat = mat;
+        rec.mat = mat.get();
+        rec.object = this;
 
         return true;
     }
@@ -51,6 +53,11 @@ class sphere : public hittable {
         origin += offset;
     }
 
+    void collect_specular_bounds(std::vector<bounding_box>& bounds) const override {
+        if (mat->is_specular())
+            bounds.push_back(get_bounds());
+    }
+
    private:
     double radius;
     shared_ptr<material> mat;
@@ -1,6 +1,7 @@
 #ifndef TRI_H
 #define TRI_H
 
+#include "../scene/material.h"
 #include "../util/utils.h"
 #include "hittable.h"
 
@@ -13,7 +14,12 @@ class triangle : public hittable {
     point3 max;
     point3 uvs[3];  // Texture coordinates for a,b,c
 
-    triangle(const point3& a, const point3& b, const point3& c, const std::string& mat_name) : a(a), b(b), c(c), mat_name(mat_name) {
+    triangle(const point3& a, const point3& b, const point3& c, const std::string& mat_name) : triangle(a, b, c, mat_name, material_slot(mat_name)) {}
+
+    // mat_slot is material_slot(mat_name), which readers making many triangles look up once per
+    // material rather than once per triangle
+    triangle(const point3& a, const point3& b, const point3& c, const std::string& mat_name, const shared_ptr<material>* mat_slot)
+        : a(a), b(b), c(c), mat_name(mat_name), mat_slot(mat_slot) {
         calc_bounds();
 
         uvs[0] = point3(0, 0, 0);
@@ -21,7 +27,8 @@ class triangle : public hittable {
         uvs[2] = point3(0, 1, 0);
     }
 
-    triangle(const point3& a, const point3& b, const point3& c, const std::string& mat_name, vec3 uvs[]) : a(a), b(b), c(c), mat_name(mat_name) {
+    triangle(const point3& a, const point3& b, const point3& c, const std::string& mat_name, const shared_ptr<material>* mat_slot, vec3 uvs[])
+        : a(a), b(b), c(c), mat_name(mat_name), mat_slot(mat_slot) {
         for (int i = 0; i < 3; ++i) {
             this->uvs[i] = uvs[i];
         }
@@ -57,8 +64,9 @@ class triangle : public hittable {
 
         rec.t = dst;
         rec.p = r.at(rec.t);
-        rec.set_face_normal(r, normal);
-        rec.mat = get_material(mat_name);
+        rec.set_face_normal(r, unit_normal);
+        rec.mat = get_material();
+        rec.object = this;
 
         // Calculate texture coordinates using barycentric coordinates
         double w = 1.0 - u - v;
@@ -68,6 +76,41 @@ class triangle : public hittable {
         return true;
     }
 
+    // Runs the tests of hit on a lane group at a time and hands only the rays that pass them to
+    // hit, which repeats them to fill in the hit record
+    void hit_packet(ray_packet& packet, uint64_t active) const override {
+        vec3xN vertex(a);
+        vec3xN face_normal(normal);
+        vec3xN ab(edgeAB);
+        vec3xN ac(edgeAC);
+        for (int g = 0; g < packet.group_count; g++) {
+            maskxN lanes = packet.group_mask(active, g);
+            if (lanes.none())
+                continue;
+
+            const rayxN& r = packet.groups[g];
+            vec3xN ao = r.origin - vertex;
+            vec3xN dao = cross(ao, r.direction);
+            realxN determinant = -dot(r.direction, face_normal);
+            if (!backface_culling_disabled)
+                lanes = lanes & maskxN(determinant >= 1e-6);
+
+            realxN invDet = 1 / determinant;
+            realxN dst = dot(ao, face_normal) * invDet;
+            realxN u = dot(ac, dao) * invDet;
+            realxN v = -dot(ab, dao) * invDet;
+            lanes = lanes & maskxN(dst >= 0) & maskxN(u >= 0) & maskxN(u <= 1) & maskxN(v >= 0) & maskxN(u + v <= 1);
+            lanes = lanes & intervalxN(broadcast<LANE_WIDTH>(packet.t_min), packet.group_closest(g)).contains(dst);
+
+            for (uint32_t bits = lanes.bits(); bits; bits &= bits - 1) {
+                int i = g * LANE_WIDTH + __builtin_ctz(bits);
+                hit_record rec;
+                if (i < packet.count && hit(packet.rays[i], interval(packet.t_min, packet.closest[i]), rec))
+                    packet.record(i, rec);
+            }
+        }
+    }
+
     bounding_box get_bounds() const override {
         return bounds;
     }
@@ -82,9 +125,33 @@ class triangle : public hittable {
         edgeAB = b - a;
         edgeAC = c - a;
         normal = cross(edgeAB, edgeAC);
+        unit_normal = unit_vector(normal);
     }
 
-    void set_material(const std::string& name) { mat_name = name; }
+    void set_material(const std::string& name) {
+        mat_name = name;
+        mat_slot = material_slot(name);
+    }
+
+    const std::string& get_material_name() const { return mat_name; }
+
+    // Material registered under the triangle's name, or the missing texture material until one is
+    const material* get_material() const { return material_in(mat_slot); }
+
+    // Unnormalized geometric normal, its length is twice the area
+    const vec3& get_normal() const { return normal; }
+
+    double area() const { return 0.5 * normal.length(); }
+
+    void collect_emitters(std::vector<const triangle*>& emitters) const override {
+        if (get_material()->is_emissive())
+            emitters.push_back(this);
+    }
+
+    void collect_specular_bounds(std::vector<bounding_box>& specular_bounds) const override {
+        if (get_material()->is_specular())
+            specular_bounds.push_back(bounds);
+    }
 
     void move_origin(const vec3& offset) override {
         a += offset;
@@ -116,11 +183,13 @@ class triangle : public hittable {
 
    private:
     std::string mat_name;
+    const shared_ptr<material>* mat_slot;  // Entry of mat_name in MATERIALS, so hits don't look the name up
     bounding_box bounds;
 
     point3 edgeAB;
     point3 edgeAC;
-    point3 normal;
+    point3 normal;     // Unnormalized, used by the intersection test
+    vec3 unit_normal;  // Shading normal for hit records
 
     bool backface_culling_disabled = false;  // Set to true to disable backface culling
 };
@@ -9,7 +9,9 @@
 #include "geometry/tri.h"
 #include "scene/camera.h"
 #include "scene/material.h"
+#include "util/alloc_tracking.h"
 #include "util/reader.h"
+#include "util/task_graph.h"
 #include "util/utils.h"
 
 using namespace std::chrono;
@@ -23,15 +25,39 @@ int main() {
     world.add(make_shared<sphere>(point3(0, -1002, 0), 1000, ground_material));
 
 
-    shared_ptr<mesh> f16 = readFile("objs/F16/F-16.obj");
-    f16->scale(.1);
-    f16->set_origin(point3(-4, -5, 0));
-    world.add(f16);
+    alloc_tracking::set_phase(alloc_phase::load);
 
-        shared_ptr<mesh> chess = readFile("objs/chess/Chess2.obj");
-    chess->scale(2);
-    chess->set_origin(point3(0, -4, 0));
-    world.add(chess);
+    // Both files are read, their textures decoded and their BVHs built side by side. Materials
+    // are registered in file order, so names the files share resolve as if read one at a time.
+    task_graph loading;
+    obj_file f16File, chessFile;
+    shared_ptr<mesh> f16, chess;
+
+    int readF16 = loading.add([&] { f16File = readObj("objs/F16/F-16.obj", &loading); });
+    int readChess = loading.add([&] { chessFile = readObj("objs/chess/Chess2.obj", &loading); });
+
+    int f16Materials = loading.add([&] { registerMaterials(f16File); }, {readF16});
+    int chessMaterials = loading.add([&] { registerMaterials(chessFile); }, {readChess, f16Materials});
+
+    int buildF16 = loading.add([&] {
+        alloc_tracking::phase_scope building(alloc_phase::build);
+        f16 = make_shared<mesh>(f16File.tris);
+        f16->scale(.1);
+        f16->set_origin(point3(-4, -5, 0));
+    }, {readF16});
+    int buildChess = loading.add([&] {
+        alloc_tracking::phase_scope building(alloc_phase::build);
+        chess = make_shared<mesh>(chessFile.tris);
+        chess->scale(2);
+        chess->set_origin(point3(0, -4, 0));
+    }, {readChess});
+
+    loading.add([&] {
+        world.add(f16);
+        world.add(chess);
+    }, {buildF16, buildChess, chessMaterials});
+
+    loading.run(shared_thread_pool());
 
     auto readFileTime = high_resolution_clock::now() - total_time;
     std::clog << "Read file time: " << duration_cast<milliseconds>(readFileTime).count() << "ms\n";
@@ -57,4 +83,6 @@ int main() {
     cam.render(world);
     auto total_time_elapsed = high_resolution_clock::now() - total_time;
     std::clog << "Total time: " << duration_cast<milliseconds>(total_time_elapsed).count() << "ms\n";
+    if (ALLOC_TRACKING_ENABLED)
+        alloc_tracking::print(std::clog);
 }
\ No newline at end of file
@@ -1,24 +1,162 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <mutex>
 #include <thread>
 
 #include "../geometry/hittable.h"
 #include "../geometry/node.h"
+#include "../scene/environment.h"
+#include "../scene/light_tree.h"
 #include "../scene/material.h"
+#include "../scene/path_guide.h"
+#include "../scene/photon_map.h"
+#include "../scene/radiance_cache.h"
+#include "../scene/ray_batch.h"
+#include "../scene/restir.h"
+#include "../scene/tiles.h"
+#include "../util/alloc_tracking.h"
+#include "../util/denoiser.h"
+#include "../util/perf_counters.h"
+#include "../util/stats.h"
 #include "../util/thread_pool.h"
 
 using namespace std::chrono;
 
+// How far a render has got, passed to camera::on_progress
+struct render_progress {
+    int pass;                // Pass being rendered, from 0
+    int tiles_done;          // Tiles of this pass finished
+    int tile_count;          // Tiles in every pass
+    double samples_done;     // Samples per pixel finished so far, counting the finished part of this pass
+    int samples_total;       // Samples per pixel the render is aiming for
+    double elapsed_seconds;  // Wall-clock time since the render started
+    double eta_seconds;      // Estimated time until the render finishes, -1 until there is something to go by
+};
+
+// The image a render produced, or as much of it as was done when it was stopped early
+struct render_result {
+    std::vector<color> pixels;  // Row by row, each the average of the samples it got
+    int width = 0, height = 0;
+    int samples_done = 0;    // Samples per pixel of every finished pass. Tiles done in a pass cut short have more.
+    bool complete = false;   // Whether every pixel got samples_per_pixel samples
+    bool cancelled = false;  // Whether it was stopped by render_control::cancel
+};
+
+// Lets other threads stop a render. Checked before every pass and every tile, so a render stops
+// within about a tile's time of being cancelled or reaching its deadline. What was rendered by
+// then is still resolved into the result.
+class render_control {
+   public:
+    high_resolution_clock::time_point deadline = high_resolution_clock::time_point::max();  // Stop once this is reached
+
+    render_control() {}
+    explicit render_control(high_resolution_clock::time_point deadline) : deadline(deadline) {}
+
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+    bool should_stop() const {
+        if (is_cancelled())
+            return true;
+        return deadline != high_resolution_clock::time_point::max() && high_resolution_clock::now() >= deadline;
+    }
+
+   private:
+    std::atomic<bool> cancelled{false};
+};
+
+// A render running on its own thread, started by camera::render_async. It uses the camera and
+// world it was started with until it finishes, so neither may change until then. Dropping or
+// replacing the job cancels it and waits for it to stop.
+class render_job {
+   public:
+    std::future<render_result> result;  // Ready once the render finishes, is cancelled or hits its deadline
+
+    render_job() {}
+    render_job(render_job&&) = default;
+
+    render_job& operator=(render_job&& other) {
+        cancel();
+        result = std::move(other.result);
+        control = std::move(other.control);
+        return *this;
+    }
+
+    ~render_job() { cancel(); }
+
+    void cancel() {
+        if (control)
+            control->cancel();
+    }
+
+    bool ready() const {
+        return result.valid() && result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+   private:
+    friend class camera;
+    std::shared_ptr<render_control> control;
+};
+
+enum class integrator_type {
+    path_tracer,  // Unidirectional path tracing with next event estimation
+    restir,       // Path tracing with reservoir-resampled direct lighting at the first hit
+};
+
 class camera {
    public:
     double aspect_ratio = 1.0;   // Ratio of image width over height
     int image_width = 100;       // Rendered image width in pixel count
     int samples_per_pixel = 10;  // Count of random samples for each pixel
     int max_depth = 10;          // Maximum number of ray bounces into scene
-    int tile_size = 16;          // Size of each tile in pixels
+    int tile_size = 16;          // Width and height of each tile in pixels
+    bool adaptive_tiles = true;  // Split slow tiles and the last tiles of a pass into quarters, so idle threads can share them
+    int min_tile_size = 8;       // Smallest tile adaptive splitting makes
+    tile_order tile_ordering = tile_order::hilbert;  // Order the tiles are rendered in
+    int frame = 0;               // Animation frame number, so each frame gets its own random numbers
+    bool sort_secondary_rays = false;  // Trace each tile's bounces as a batch sorted by origin and direction
+    int primary_split = 1;             // Paths fanned out from the first hit of each camera ray
+    bool adaptive_split = false;       // Scale primary_split by the roughness of the surface hit
+    bool packet_tracing = false;       // Trace camera rays through the BVH in packets of neighbouring pixels
+
+    int thread_count = 0;                                     // Render threads, 0 for one per hardware thread, or per core when pinned
+    affinity_policy thread_affinity = affinity_policy::none;  // How render threads are pinned to CPUs
+    bool replicate_bvh = false;                               // Give each NUMA node its own copy of the mesh hierarchies, when threads are pinned
+
+    bool progressive = false;                    // Render the image in passes until samples_per_pixel or time_budget is reached
+    int samples_per_pass = 1;                    // Samples per pixel added by each progressive pass
+    double time_budget = 0;                      // Wall-clock seconds a progressive render may take, 0 for no limit
+    int snapshot_every = 0;                      // Write the image so far every this many passes, 0 to disable
+    std::string snapshot_file = "snapshot.ppm";  // Where progressive snapshots are written
+
+    // Called whenever tiles finish, from the thread that finished one, never from two threads at
+    // once. Updates that would wait on a running call are dropped, except the last of each pass.
+    // Without one, progress is written to std::clog.
+    std::function<void(const render_progress&)> on_progress;
+
+    shared_ptr<environment> background = make_shared<gradient_sky>();  // Light arriving from outside the scene
+    bool next_event_estimation = true;                                  // Sample the environment and emitters directly at diffuse hits
+
+    integrator_type integrator = integrator_type::path_tracer;  // How each pixel sample is estimated
+    restir_settings restir;                                     // Settings for the restir integrator
+
+    bool path_guiding = false;  // Learn where indirect light comes from and aim diffuse bounces at it
+    path_guide guide;           // Settings and learned state of the path guide
+
+    bool radiance_caching = false;  // End paths at cached radiance once they have bounced cache.query_depth times
+    radiance_cache cache;           // Settings and contents of the radiance cache
+
+    bool caustic_photons = false;  // Light caustics from metal and glass with a photon map built every pass
+    photon_map caustics;           // Settings and photons of the caustic photon map
+
+    bool denoise = false;     // Filter the finished image using first-hit albedo, normal and depth
+    denoiser image_denoiser;  // Settings for the denoise pass
 
     double vfov = 90;                   // Vertical view angle (field of view)
     point3 lookfrom = point3(0, 0, 0);  // Point camera is looking from
@@ -28,61 +166,204 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    // Renders the world and writes the image to std::cout as a PPM
     void render(const hittable& world) {
+        render_frame(world, render_control(), &std::cout);
+    }
+
+    // Renders the world and returns the image instead of writing it. Stops early, with whatever
+    // was rendered by then, if control is cancelled or reaches its deadline.
+    render_result render_image(const hittable& world, const render_control& control) {
+        return render_frame(world, control, nullptr);
+    }
+
+    // Starts rendering the world on another thread and returns at once. The job's result holds
+    // the image once it is done, or as much of it as was rendered by deadline. Renders of one
+    // camera take turns, so a job replacing a running one starts once the old one has stopped.
+    render_job render_async(const hittable& world, high_resolution_clock::time_point deadline = high_resolution_clock::time_point::max()) {
+        render_job job;
+        job.control = std::make_shared<render_control>(deadline);
+        std::shared_ptr<render_control> control = job.control;
+        job.result = std::async(std::launch::async, [this, &world, control] { return render_frame(world, *control, nullptr); });
+        return job;
+    }
+
+   private:
+    // Sized without being written, so the pool's threads touch its pages first
+    using pixel_buffer = std::vector<colorf, first_touch_allocator<colorf>>;
+
+    // Everything the tile jobs of a render write to
+    struct render_buffers {
+        pixel_buffer accumulator;           // Sum of all samples taken per pixel, tile-major as laid out by layout
+        feature_buffers features;           // Sum of the first-hit features per pixel, empty unless denoising
+        std::vector<reservoir> reservoirs;  // Each pixel's ReSTIR reservoir from its last sample
+        std::vector<int> tile_samples;      // Samples per pixel each tile has finished
+        std::vector<double> tile_seconds;   // Thread time each tile took in the last pass
+        std::vector<double> tail_idle;      // Seconds each thread spent waiting at the end of passes, the render thread first
+        int tiles_split = 0;                // Tiles split into quarters over all passes
+    };
+
+    // Renders the image, writing it to out if given, and reports how long each part took
+    render_result render_frame(const hittable& world, const render_control& control, std::ostream* out) {
+        std::unique_lock<std::mutex> rendering(render_mutex);
+        alloc_tracking::set_phase(alloc_phase::render);
+        uint64_t allocations_before = alloc_tracking::count(alloc_phase::render);
+        uint64_t hot_allocations_before = alloc_tracking::forbidden_count();
         initialize();
 
         auto render_start = high_resolution_clock::now();
-        std::vector<color> frameBuffer(image_width * image_height);
-        int thread_pixel_count = tile_size * tile_size;  // Number of pixels to render per thread
+        traversal_stats::reset_totals();
+        framebuffer_stats::reset_totals();
+        lights.build(world);
+        render_buffers buffers;
+        tiles = make_tiles(image_width, image_height, tile_size, tile_ordering);
+        layout = tile_major_layout(image_width, image_height, tile_size, tiles, LINE_BYTES / sizeof(colorf));
+        buffers.accumulator.resize(layout.size());  // Left untouched until the pool zeroes it
+        if (denoise)
+            buffers.features.resize(image_width * image_height);
+        if (integrator == integrator_type::restir)
+            buffers.reservoirs.resize(image_width * image_height);
+        if (path_guiding)
+            guide.reset();
+        if (radiance_caching)
+            cache.reset();
+        buffers.tile_samples.assign(tiles.size(), 0);
+        buffers.tile_seconds.assign(tiles.size(), 0);
+
+        // Counters follow the pool's threads only if they are started first
+        perf_counters counters;
+        if (PERF_COUNTERS_ENABLED)
+            counters.start();
         ThreadPool threadPool;
-        threadPool.Start();
-
-        int pixels_queued = 0;
-        while (pixels_queued < image_height * image_width) {
-            // Queue a job to render thread_pixel_count pixels
-            if (pixels_queued + thread_pixel_count <= image_height * image_width) {
-                threadPool.QueueJob([this, &world, &frameBuffer, pixels_queued, thread_pixel_count]() {
-                    for (int z = 0; z < thread_pixel_count; z++) {
-                        int pixel_index = pixels_queued + z;
-                        int i = pixel_index % image_width;
-                        int j = pixel_index / image_width;
-
-                        color pixel_color(0, 0, 0);
-                        for (int sample = 0; sample < samples_per_pixel; sample++) {
-                            ray r = get_ray(i, j);
-                            pixel_color += ray_color(r, max_depth, world);
-                        }
-                        frameBuffer[pixel_index] = pixel_samples_scale * pixel_color;
-                    }
-                });
-                pixels_queued += thread_pixel_count;
-            } else {
-                // If there are < thread_pixel_count pixels remaining, adjust the count
-                int pixels_remaining = image_height * image_width - pixels_queued;
-                thread_pixel_count = pixels_remaining;
+        threadPool.Start(thread_count, thread_affinity);
+        first_touch(threadPool, buffers.accumulator);
+        buffers.tail_idle.assign(threadPool.thread_count() + 1, 0);
+
+        const cpu_topology& topology = cpu_topology::get();
+        bool replicated = replicate_bvh && thread_affinity != affinity_policy::none && topology.numa_node_count > 1;
+        if (replicated)
+            world.replicate_for_numa(topology.numa_node_count);
+
+        // Without progressive mode the whole image is one pass of every sample
+        int samples_done = 0;
+        int passes = 0;
+        high_resolution_clock::duration photon_time(0);
+        bool stopped = false;  // Whether control ended the render early
+        bool pass_cut_short = false;
+        while (samples_done < samples_per_pixel) {
+            if (control.should_stop()) {
+                stopped = true;
+                break;
             }
-        }
 
-        while (int thread_count = threadPool.size()) {
-            std::clog << "\rRendering... " << thread_count << " tiles remaining.";
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (progressive && time_budget > 0 && passes > 0) {
+                // Stop if the next pass is not expected to finish before the deadline
+                auto elapsed = high_resolution_clock::now() - render_start;
+                auto average_pass = elapsed / passes;
+                if (elapsed + average_pass > duration_cast<high_resolution_clock::duration>(duration<double>(time_budget)))
+                    break;
+            }
+
+            int samples_remaining = samples_per_pixel - samples_done;
+            int pass_samples = progressive ? std::min(std::max(samples_per_pass, 1), samples_remaining) : samples_remaining;
+
+            // The path guide learns from a few short passes before it is trusted with the rest
+            if (path_guiding && passes < guide.training_passes)
+                pass_samples = std::min(1 << passes, samples_remaining);
+
+            if (caustic_photons) {
+                auto photon_start = high_resolution_clock::now();
+                caustics.build(world, lights, *background, passes, frame, threadPool);
+                photon_time += high_resolution_clock::now() - photon_start;
+            }
+
+            if (!render_pass(world, threadPool, buffers, samples_done, pass_samples, passes, render_start, control)) {
+                stopped = pass_cut_short = true;
+                break;
+            }
+            samples_done += pass_samples;
+            passes++;
+
+            if (path_guiding)
+                guide.update_distributions();
+
+            if (progressive && snapshot_every > 0 && passes % snapshot_every == 0) {
+                std::ofstream snapshot(snapshot_file);
+                write_framebuffer(snapshot, resolve(buffers), image_width, image_height);
+            }
         }
-        threadPool.Stop();
         auto render_time = high_resolution_clock::now() - render_start;
 
+        render_result result;
+        result.width = image_width;
+        result.height = image_height;
+        result.samples_done = samples_done;
+        result.complete = samples_done == samples_per_pixel;
+        result.cancelled = stopped && control.is_cancelled();
+        result.pixels = resolve(buffers);
+        std::vector<color>& frameBuffer = result.pixels;
+
+        // The features of a pass cut short are summed over differing sample counts
+        auto denoise_start = high_resolution_clock::now();
+        if (denoise && !pass_cut_short)
+            image_denoiser.denoise(frameBuffer, buffers.features.resolve(samples_done), image_width, image_height, threadPool);
+        auto denoise_time = high_resolution_clock::now() - denoise_start;
+        int threadCount = threadPool.thread_count();
+        threadPool.Stop();
+        if (PERF_COUNTERS_ENABLED)
+            counters.stop();
+
+        uint64_t allocations = alloc_tracking::count(alloc_phase::render) - allocations_before;
+        uint64_t hot_allocations = alloc_tracking::forbidden_count() - hot_allocations_before;
+
         auto write_start = high_resolution_clock::now();
-        write_framebuffer(std::cout, frameBuffer, image_width, image_height);
+        if (out) {
+            alloc_tracking::set_phase(alloc_phase::write);
+            write_framebuffer(*out, frameBuffer, image_width, image_height);
+        }
         std::clog << "\rRender time: " << duration_cast<milliseconds>(high_resolution_clock::now() - render_start).count() << "ms               \n";
         std::clog << "-Calculation time: " << duration_cast<milliseconds>(render_time).count() << "ms\n";
-        double numTiles = ceil(double(image_height * image_width) / (tile_size * tile_size));
-        double msPerTile = duration_cast<milliseconds>(render_time).count() / numTiles;
-        std::clog << "-ms per tile: " << msPerTile << "ms\n";
-        std::clog << "-Write time: " << duration_cast<milliseconds>(high_resolution_clock::now() - write_start).count() << "ms\n\n";
+        if (denoise)
+            std::clog << "-Denoise time: " << duration_cast<milliseconds>(denoise_time).count() << "ms\n";
+        if (caustic_photons)
+            std::clog << "-Photon time: " << duration_cast<milliseconds>(photon_time).count() << "ms (" << caustics.size() << " caustic photons in the last pass)\n";
+        std::clog << "-Threads: " << threadCount;
+        if (thread_affinity != affinity_policy::none)
+            std::clog << " pinned " << (thread_affinity == affinity_policy::compact ? "compact" : "scatter") << " over "
+                      << topology.numa_node_count << (topology.numa_node_count == 1 ? " NUMA node" : " NUMA nodes")
+                      << (replicated ? ", BVH replicated per node" : "");
+        std::clog << "\n";
+        std::clog << "-Samples per pixel: " << samples_done << " in " << passes << (passes == 1 ? " pass" : " passes");
+        if (stopped)
+            std::clog << (result.cancelled ? ", cancelled" : ", deadline reached");
+        std::clog << "\n";
+        // A render stopped before its first pass finished has no whole pass to time tiles by
+        if (passes > 0) {
+            double numTiles = double(passes) * tiles.size();
+            double msPerTile = duration_cast<milliseconds>(render_time).count() / numTiles;
+            std::clog << "-ms per tile: " << msPerTile << "ms\n";
+        }
+        if (adaptive_tiles)
+            std::clog << "-Tiles split: " << buffers.tiles_split << "\n";
+        std::clog << "-Tail idle per thread:";
+        for (double idle : buffers.tail_idle)
+            std::clog << " " << std::round(idle * 1e4) / 10 << "ms";
+        std::clog << " (render thread first)\n";
+        if (TRAVERSAL_STATS_ENABLED)
+            print_traversal_stats(render_time);
+        if (FRAMEBUFFER_STATS_ENABLED)
+            print_framebuffer_stats();
+        if (PERF_COUNTERS_ENABLED)
+            counters.print(std::clog);
+        if (ALLOC_TRACKING_ENABLED)
+            std::clog << "-Heap allocations: " << allocations << " (" << hot_allocations << " while tracing rays)\n";
+        if (out)
+            std::clog << "-Write time: " << duration_cast<milliseconds>(high_resolution_clock::now() - write_start).count() << "ms\n";
+        std::clog << "\n";
+        return result;
     }
 
-   private:
     int image_height;            // Rendered image height
-    double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
     point3 center;               // Camera center
     point3 pixel00_loc;          // Location of pixel 0, 0
     vec3 pixel_delta_u;          // Offset to pixel to the right
@@ -90,13 +371,19 @@ class camera {
     vec3 u, v, w;                // Camera frame basis vectors
     vec3 defocus_disk_u;         // Defocus disk horizontal radius
     vec3 defocus_disk_v;         // Defocus disk vertical radius
+    light_tree lights;           // Emissive triangles of the world being rendered
+    std::vector<image_tile> tiles;  // The image split into tiles, in render order
+    tile_major_layout layout;       // Where each pixel lives in the accumulator
+    std::mutex render_mutex;        // Held by the render in progress, so a job replacing another waits for it to stop
+
+    static const int RAY_BATCH_SIZE = 4096;  // Paths in flight per batch when sorting secondary rays
+    static const int LINE_BYTES = 64;        // Cache line size the accumulator and tile staging are aligned to
+    static constexpr double SLOW_TILE_FACTOR = 4;  // Times the average tile time that gets a tile split from the start of a pass
 
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        pixel_samples_scale = 1.0 / samples_per_pixel;
-
         center = lookfrom;
 
         // Determine viewport dimensions.
@@ -128,14 +415,694 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
+    // Zeroes buffer in one contiguous band per worker. Under Linux's first-touch policy each page
+    // then lives on the NUMA node of the thread that wrote it first, instead of all of them on the
+    // node of the thread that sized the buffer.
+    static void first_touch(ThreadPool& threadPool, pixel_buffer& buffer) {
+        int size = int(buffer.size());
+        int band = (size + std::max(threadPool.thread_count(), 1) - 1) / std::max(threadPool.thread_count(), 1);
+        threadPool.parallel_for(0, size, band, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                ::new (static_cast<void*>(&buffer[i])) colorf();
+        });
+    }
+
+    // Renders every tile on the pool, adding the given number of samples, numbered from
+    // first_sample, to every pixel of the accumulator. Returns once the last tile is done, false if
+    // control stopped the pass before every tile was rendered.
+    bool render_pass(const hittable& world, ThreadPool& threadPool, render_buffers& buffers, int first_sample, int samples, int pass,
+                     high_resolution_clock::time_point render_start, const render_control& control) const {
+        std::atomic<int> tiles_started = 0;
+        std::atomic<int> tiles_done = 0;
+        std::atomic<int> tiles_split = 0;
+        std::atomic<bool> skipped = false;
+        std::mutex progress_mutex;
+
+        // Tiles that took several times the average last pass are split from the start, the rest
+        // only once there are fewer tiles left to start than threads to take them
+        double mean_seconds = 0;
+        for (double seconds : buffers.tile_seconds)
+            mean_seconds += seconds / tiles.size();
+
+        tile_schedule schedule;
+        schedule.pass_start = high_resolution_clock::now();
+        schedule.last_finish.assign(buffers.tail_idle.size(), schedule.pass_start);
+        schedule.should_split = [&](const image_tile& tile, double last_seconds) {
+            if (!adaptive_tiles || integrator == integrator_type::restir)
+                return false;
+            if (tile.width < 2 * min_tile_size || tile.height < 2 * min_tile_size)
+                return false;
+
+            bool tail = int(tiles.size()) - tiles_started.load(std::memory_order_relaxed) < threadPool.thread_count();
+            bool slow = mean_seconds > 0 && last_seconds > SLOW_TILE_FACTOR * mean_seconds;
+            if (tail || slow)
+                tiles_split++;
+            return tail || slow;
+        };
+
+        threadPool.parallel_for(0, int(tiles.size()), 1, [&](int first_tile, int last_tile) {
+            for (int t = first_tile; t < last_tile; t++) {
+                tiles_started++;
+                if (control.should_stop()) {
+                    skipped = true;
+                    continue;
+                }
+
+                {
+                    // Splitting, rendering and committing the tile, all but the growth of the
+                    // thread's scratch buffers
+                    no_alloc_scope no_alloc;
+                    buffers.tile_seconds[t] = render_tile(world, threadPool, buffers, tiles[t], buffers.tile_seconds[t], first_sample, samples, schedule);
+                    buffers.tile_samples[t] += samples;
+                    if (TRAVERSAL_STATS_ENABLED)
+                        local_traversal_stats().flush();
+                }
+
+                // Only the pass's last tile waits for its turn to report, the rest skip a busy reporter
+                int done = ++tiles_done;
+                std::unique_lock<std::mutex> lock(progress_mutex, std::defer_lock);
+                if (done == int(tiles.size()))
+                    lock.lock();
+                else if (!lock.try_lock())
+                    continue;
+
+                render_progress progress;
+                progress.pass = pass;
+                progress.tiles_done = done;
+                progress.tile_count = int(tiles.size());
+                progress.samples_done = first_sample + double(samples) * done / tiles.size();
+                progress.samples_total = samples_per_pixel;
+                progress.elapsed_seconds = duration_cast<duration<double>>(high_resolution_clock::now() - render_start).count();
+                progress.eta_seconds = estimate_remaining(progress);
+                report_progress(progress);
+            }
+        });
+
+        // Every thread was idle from its last tile until the pass ended
+        auto pass_end = high_resolution_clock::now();
+        for (size_t i = 0; i < buffers.tail_idle.size(); i++)
+            buffers.tail_idle[i] += duration_cast<duration<double>>(pass_end - schedule.last_finish[i]).count();
+        buffers.tiles_split += tiles_split;
+        return !skipped;
+    }
+
+    // How render_tile splits up the tiles of one pass
+    struct tile_schedule {
+        std::function<bool(const image_tile& tile, double last_seconds)> should_split;
+        high_resolution_clock::time_point pass_start;
+        std::vector<high_resolution_clock::time_point> last_finish;  // When each thread, the render thread first, last finished a tile
+        std::mutex quarter_commits;  // Held while a quarter of a split tile commits, as quarters share cache lines with their neighbours
+    };
+
+    // Renders one tile, or its quarters side by side on the pool if the schedule splits it, and
+    // returns the thread time it took. last_seconds is what it took last pass, 0 if unknown.
+    // quarter is whether tile is part of a split tile.
+    double render_tile(const hittable& world, ThreadPool& threadPool, render_buffers& buffers, const image_tile& tile, double last_seconds,
+                       int first_sample, int samples, tile_schedule& schedule, bool quarter = false) const {
+        if (schedule.should_split(tile, last_seconds)) {
+            std::array<image_tile, 4> quadrants = tile.quadrants();
+            return threadPool.parallel_reduce(0, 4, 1, 0.0, [&](int first, int last) {
+                double seconds = 0;
+                for (int q = first; q < last; q++)
+                    seconds += render_tile(world, threadPool, buffers, quadrants[q], last_seconds / 4, first_sample, samples, schedule, true);
+                return seconds;
+            }, std::plus<double>());
+        }
+
+        auto start = high_resolution_clock::now();
+        if (integrator == integrator_type::restir)
+            render_pixels_restir(world, buffers, tile, first_sample, samples);
+        else if (sort_secondary_rays)
+            render_pixels_batched(world, buffers, tile, first_sample, samples);
+        else if (packet_tracing)
+            render_pixels_packets(world, buffers, tile, first_sample, samples);
+        else
+            render_pixels(world, buffers, tile, first_sample, samples);
+
+        // A whole tile has its cache lines to itself, the quarters of split ones take turns
+        std::unique_lock<std::mutex> committing(schedule.quarter_commits, std::defer_lock);
+        if (quarter)
+            committing.lock();
+        commit_tile(buffers, tile, local_scratch().pixels, local_staging().sums());
+
+        auto finish = high_resolution_clock::now();
+        schedule.last_finish[threadPool.worker_index() + 1] = finish;
+        return duration_cast<duration<double>>(finish - start).count();
+    }
+
+    // Time left if the rest of the samples go as fast as the ones so far, cut short by the time
+    // budget of a progressive render
+    double estimate_remaining(const render_progress& progress) const {
+        if (progress.samples_done <= 0 || progress.elapsed_seconds <= 0)
+            return -1;
+
+        double seconds_per_sample = progress.elapsed_seconds / progress.samples_done;
+        double remaining = std::max(0.0, (progress.samples_total - progress.samples_done) * seconds_per_sample);
+        if (progressive && time_budget > 0)
+            remaining = std::min(remaining, std::max(0.0, time_budget - progress.elapsed_seconds));
+        return remaining;
+    }
+
+    void report_progress(const render_progress& progress) const {
+        if (on_progress) {
+            on_progress(progress);
+            return;
+        }
+
+        int tiles_remaining = progress.tile_count - progress.tiles_done;
+        if (progressive)
+            std::clog << "\rRendering pass " << progress.pass + 1 << "... " << tiles_remaining << " tiles remaining.";
+        else
+            std::clog << "\rRendering... " << tiles_remaining << " tiles remaining.";
+        if (progress.eta_seconds >= 0)
+            std::clog << " ETA " << std::round(progress.eta_seconds * 10) / 10 << "s.   ";
+    }
+
+    // The sums of the tile a thread is rendering, pixel by pixel in render order, added to the
+    // accumulator in one go by render_tile once the tile is done. Kept per thread and reused, so tiles allocate
+    // nothing for it, and cache line aligned, so no other thread's data shares its lines.
+    class tile_staging {
+       public:
+        // Zeroed sums for count pixels
+        colorf* reset(int count) {
+            lines.assign((count + LINE_PIXELS - 1) / LINE_PIXELS, pixel_line());
+            return lines.empty() ? nullptr : lines[0].pixels;
+        }
+
+        const colorf* sums() const { return lines.empty() ? nullptr : lines[0].pixels; }
+
+       private:
+        static const int LINE_PIXELS = LINE_BYTES / sizeof(colorf);
+        struct alignas(LINE_BYTES) pixel_line {
+            colorf pixels[LINE_PIXELS];
+        };
+        std::vector<pixel_line> lines;
+    };
+
+    static tile_staging& local_staging() {
+        thread_local tile_staging staging;
+        return staging;
+    }
+
+    // Working buffers of the tile a thread is rendering. Kept per thread like its staging and only
+    // ever grown, so once a thread has rendered a tile of each size its tiles allocate nothing.
+    struct tile_scratch {
+        std::vector<int> pixels;  // Image index of each pixel, in the order they are rendered
+        std::unique_ptr<ray_packet> packet;
+        ray_batch batch;
+        std::vector<path_state> camera_paths;
+        std::vector<ray> rays;
+        std::vector<hit_record> hits;
+        std::vector<bool> resampled;  // Whether the camera ray hit a diffuse surface
+        std::vector<reservoir> initial;
+        std::vector<reservoir> reused;
+        std::vector<random_stream> streams;  // Each pixel's stream between the three ReSTIR steps, or each camera ray's in a batch
+        std::vector<vec3> offsets;           // Where in its pixel each camera ray of a batch goes through
+        std::vector<double> disk_u1, disk_u2, disk_x, disk_y;  // Defocus disk points of a batch's camera rays, before and after warping
+        std::vector<int> tile_order_of;      // Where each pixel of the tile, row by row, comes in pixels
+    };
+
+    static tile_scratch& local_scratch() {
+        thread_local tile_scratch scratch;
+        return scratch;
+    }
+
+    // Adds the staged sums of a tile's pixels, listed in render order, to the accumulator
+    void commit_tile(render_buffers& buffers, const image_tile& tile, const std::vector<int>& pixels, const colorf* staged) const {
+        for (size_t z = 0; z < pixels.size(); z++)
+            buffers.accumulator[layout.index(pixels[z] % image_width, pixels[z] / image_width)] += staged[z];
+
+        if (FRAMEBUFFER_STATS_ENABLED) {
+            uint64_t lines = 0, shared = 0, scanline_lines = 0, scanline_shared = 0;
+            layout.count_lines(tile, lines, shared);
+            layout.count_scanline_lines(tile, image_height, scanline_lines, scanline_shared);
+            framebuffer_stats::record(lines, shared, scanline_lines, scanline_shared);
+        }
+    }
+
+    // Averages the accumulated samples into displayable pixel colors, tile by tile since a pass
+    // stopped early leaves some tiles with more samples than others
+    std::vector<color> resolve(const render_buffers& buffers) const {
+        std::vector<color> frameBuffer(image_width * image_height);
+        for (size_t t = 0; t < tiles.size(); t++) {
+            const image_tile& tile = tiles[t];
+            double pixel_samples_scale = 1.0 / std::max(buffers.tile_samples[t], 1);  // Color scale factor for a sum of pixel samples
+            for (int j = tile.y; j < tile.y + tile.height; j++) {
+                int slot = layout.index(tile.x, j);
+                for (int i = tile.x; i < tile.x + tile.width; i++)
+                    frameBuffer[j * image_width + i] = pixel_samples_scale * color(buffers.accumulator[slot++]);
+            }
+        }
+
+        return frameBuffer;
+    }
+
+    // Adds samples samples of every pixel of tile to the thread's staging, leaving the pixels in
+    // render order in its scratch, for render_tile to commit
+    void render_pixels(const hittable& world, render_buffers& buffers, const image_tile& tile, int first_sample, int samples) const {
+        // Scratch buffers may grow to fit the tile up to the no_alloc_scope below, the tile is
+        // then rendered without allocating
+        growth_scope growing;
+        std::vector<int>& pixels = local_scratch().pixels;
+        tile.pixels(image_width, pixels);
+        int pixel_count = int(pixels.size());
+        feature_buffers& features = buffers.features;
+
+        colorf* staged = local_staging().reset(pixel_count);
+
+        no_alloc_scope no_alloc;
+        for (int z = 0; z < pixel_count; z++) {
+            int pixel_index = pixels[z];
+            int i = pixel_index % image_width;
+            int j = pixel_index / image_width;
+
+            colorf& pixel_color = staged[z];
+            for (int sample = 0; sample < samples; sample++) {
+                seed_random(pixel_index, first_sample + sample, frame);
+                ray r = get_ray(i, j);
+                if (features.empty()) {
+                    pixel_color += colorf(ray_color(r, max_depth, world));
+                } else {
+                    surface_features first_hit;
+                    pixel_color += colorf(ray_color(r, max_depth, world, &first_hit));
+                    features.add(pixel_index, first_hit);
+                }
+            }
+        }
+    }
+
+    // Same result as render_pixels, but finds the first hits of each sample's camera rays in packets
+    // of up to ray_packet::MAX_RAYS neighbouring pixels before shading them one at a time. Tile
+    // pixels come in Morton order, so each packet is an 8x8 block when the tile is big enough.
+    void render_pixels_packets(const hittable& world, render_buffers& buffers, const image_tile& tile, int first_sample, int samples) const {
+        growth_scope growing;  // As in render_pixels
+        tile_scratch& scratch = local_scratch();
+        std::vector<int>& pixels = scratch.pixels;
+        tile.pixels(image_width, pixels);
+        int pixel_count = int(pixels.size());
+        feature_buffers& features = buffers.features;
+        colorf* pixel_colors = local_staging().reset(pixel_count);
+        if (!scratch.packet)
+            scratch.packet = std::make_unique<ray_packet>();
+        ray_packet* packet = scratch.packet.get();
+        random_stream streams[ray_packet::MAX_RAYS];  // Each ray's sample stream, to shade it with after the packet is traced
+
+        no_alloc_scope no_alloc;
+        for (int first = 0; first < pixel_count; first += ray_packet::MAX_RAYS) {
+            int count = std::min(ray_packet::MAX_RAYS, pixel_count - first);
+            for (int sample = 0; sample < samples; sample++) {
+
+                packet->clear();
+                for (int k = 0; k < count; k++) {
+                    int pixel_index = pixels[first + k];
+                    seed_random(pixel_index, first_sample + sample, frame);
+                    packet->add(get_ray(pixel_index % image_width, pixel_index / image_width));
+                    streams[k] = current_random_stream();
+                }
+                packet->prepare();
+
+                if (TRAVERSAL_STATS_ENABLED) {
+                    local_traversal_stats().primary = true;
+                    for (int k = 0; k < count; k++)
+                        local_traversal_stats().record_ray();
+                }
+                world.hit_packet(*packet, packet->all_rays());
+                if (TRAVERSAL_STATS_ENABLED)
+                    local_traversal_stats().primary = false;
+
+                for (int k = 0; k < count; k++) {
+                    if (max_depth <= 0)
+                        continue;
+
+                    current_random_stream() = streams[k];
+                    surface_features first_hit;
+                    path_state path{packet->rays[k], color(1, 1, 1), first + k};
+                    color radiance(0, 0, 0);
+                    shade_primary(path, packet->hit[k] ? &packet->records[k] : nullptr, radiance, world, features.empty() ? nullptr : &first_hit, [&](const path_state& branch) {
+                        continue_camera_path(branch, max_depth, radiance, world);
+                    });
+                    pixel_colors[first + k] += colorf(radiance);
+                    if (!features.empty())
+                        features.add(pixels[first + k], first_hit);
+                }
+            }
+        }
+    }
+
+    // Same result as render_pixels, but advances all paths of the tile one bounce at a time and
+    // reorders the bounced rays in between, so rays that traverse the same part of the BVH are
+    // traced back to back
+    void render_pixels_batched(const hittable& world, render_buffers& buffers, const image_tile& tile, int first_sample, int samples) const {
+        growth_scope growing;  // As in render_pixels
+        tile_scratch& scratch = local_scratch();
+        std::vector<int>& pixels = scratch.pixels;
+        tile.pixels(image_width, pixels);
+        int pixel_count = int(pixels.size());
+        feature_buffers& features = buffers.features;
+        colorf* pixel_colors = local_staging().reset(pixel_count);
+        int samples_per_batch = std::max(1, std::min(samples, RAY_BATCH_SIZE / (pixel_count * std::max(primary_split, 1))));
+        ray_batch& batch = scratch.batch;
+        std::vector<path_state>& camera_paths = scratch.camera_paths;
+
+        // A batch never holds more paths than its camera rays split into
+        size_t max_paths = size_t(pixel_count) * samples_per_batch * std::max(primary_split, 1);
+        batch.reserve(max_paths);
+        camera_paths.reserve(max_paths);
+
+        // Random numbers of each batch's camera rays
+        size_t max_rays = size_t(pixel_count) * samples_per_batch;
+        std::vector<vec3>& offsets = scratch.offsets;
+        std::vector<double>& disk_u1 = scratch.disk_u1;
+        std::vector<double>& disk_u2 = scratch.disk_u2;
+        std::vector<double>& disk_x = scratch.disk_x;
+        std::vector<double>& disk_y = scratch.disk_y;
+        std::vector<random_stream>& streams = scratch.streams;
+        offsets.resize(max_rays);
+        streams.resize(max_rays);
+        if (defocus_angle > 0) {
+            disk_u1.resize(max_rays);
+            disk_u2.resize(max_rays);
+            disk_x.resize(max_rays);
+            disk_y.resize(max_rays);
+        }
+
+        no_alloc_scope no_alloc;
+        for (int sample = 0; sample < samples; sample += samples_per_batch) {
+            int batch_samples = std::min(samples_per_batch, samples - sample);
+
+            // Draw the random numbers of every camera ray from its own sample's stream, in the
+            // order get_ray does, then warp all the defocus disk points at once
+            int ray_count = 0;
+            for (int z = 0; z < pixel_count; z++) {
+                for (int s = 0; s < batch_samples; s++) {
+                    seed_random(pixels[z], first_sample + sample + s, frame);
+                    offsets[ray_count] = sample_square();
+                    if (defocus_angle > 0) {
+                        disk_u1[ray_count] = random_double();
+                        disk_u2[ray_count] = random_double();
+                    }
+                    streams[ray_count++] = current_random_stream();
+                }
+            }
+            if (defocus_angle > 0)
+                concentric_disk(ray_count, disk_u1.data(), disk_u2.data(), disk_x.data(), disk_y.data());
+
+            batch.clear();
+            for (int k = 0; k < ray_count; k++) {
+                int z = k / batch_samples;
+                int i = pixels[z] % image_width;
+                int j = pixels[z] / image_width;
+                batch.add(defocus_angle > 0 ? camera_ray(i, j, offsets[k], disk_x[k], disk_y[k]) : camera_ray(i, j, offsets[k], 0, 0), z);
+                batch.paths.back().rng = streams[k];
+            }
+
+            // Camera rays are already coherent in pixel order. Their branches become the batch.
+            camera_paths.swap(batch.paths);
+            batch.clear();
+            for (auto& path : camera_paths) {
+                surface_features first_hit;
+                current_random_stream() = path.rng;
+                color radiance(0, 0, 0);
+                trace_primary(path, radiance, world, features.empty() ? nullptr : &first_hit, [&](const path_state& branch) {
+                    batch.paths.push_back(branch);
+                    batch.paths.back().rng = current_random_stream();
+                });
+                pixel_colors[path.pixel] += colorf(radiance);
+                if (!features.empty())
+                    features.add(pixels[path.pixel], first_hit);
+            }
+
+            for (int depth = max_depth - 1; depth > 0 && !batch.empty(); depth--) {
+                batch.sort();
+
+                size_t alive = 0;
+                for (auto& path : batch.paths) {
+                    // Each path keeps drawing from its own sample's stream, wherever sorting put it
+                    current_random_stream() = path.rng;
+                    color radiance(0, 0, 0);
+                    bool continues = trace_segment(path, radiance, world);
+                    pixel_colors[path.pixel] += colorf(radiance);
+                    path.rng = current_random_stream();
+                    if (continues)
+                        batch.paths[alive++] = path;
+                    else
+                        finish_path(path);
+                }
+                batch.truncate(alive);
+            }
+
+            // Paths cut off by max_depth
+            for (const auto& path : batch.paths)
+                finish_path(path);
+        }
+    }
+
+    // Like render_pixels, but direct light from emitters at each camera ray's hit comes from
+    // weighted reservoir resampling of light tree candidates, reusing the pixel's reservoir from its
+    // previous sample and those of neighbouring pixels in the same tile. Only the surviving sample
+    // of each pixel gets a shadow ray. Reuse ignores visibility, which trades a little bias for
+    // much faster convergence with many emitters. The rest of the path is traced as usual.
+    void render_pixels_restir(const hittable& world, render_buffers& buffers, const image_tile& tile, int first_sample, int samples) const {
+        growth_scope growing;  // As in render_pixels
+        tile_scratch& scratch = local_scratch();
+        std::vector<int>& pixels = scratch.pixels;
+        tile.pixels(image_width, pixels);
+        int pixel_count = int(pixels.size());
+        std::vector<ray>& rays = scratch.rays;
+        std::vector<hit_record>& hits = scratch.hits;
+        std::vector<bool>& resampled = scratch.resampled;
+        std::vector<reservoir>& initial = scratch.initial;
+        std::vector<reservoir>& reused = scratch.reused;
+        std::vector<random_stream>& streams = scratch.streams;
+        std::vector<int>& tile_order_of = scratch.tile_order_of;
+        rays.resize(pixel_count);
+        hits.resize(pixel_count);
+        resampled.resize(pixel_count);
+        initial.resize(pixel_count);
+        reused.resize(pixel_count);
+        streams.resize(pixel_count);
+        tile_order_of.resize(pixel_count);
+        colorf* staged = local_staging().reset(pixel_count);
+
+        for (int z = 0; z < pixel_count; z++)
+            tile_order_of[(pixels[z] / image_width - tile.y) * tile.width + pixels[z] % image_width - tile.x] = z;
+
+        no_alloc_scope no_alloc;
+        for (int sample = 0; sample < samples; sample++) {
+            // Trace the camera rays and resample light candidates at every diffuse hit
+            for (int z = 0; z < pixel_count; z++) {
+                int pixel_index = pixels[z];
+                seed_random(pixel_index, first_sample + sample, frame);
+                rays[z] = get_ray(pixel_index % image_width, pixel_index / image_width);
+
+                if (TRAVERSAL_STATS_ENABLED) {
+                    local_traversal_stats().primary = true;
+                    local_traversal_stats().record_ray();
+                }
+
+                hits[z] = hit_record();
+                resampled[z] = world.hit(rays[z], interval(0.001, infinity), hits[z]) && hits[z].mat->is_diffuse();
+                if (TRAVERSAL_STATS_ENABLED)
+                    local_traversal_stats().primary = false;
+                if (resampled[z]) {
+                    initial[z] = initial_reservoir(hits[z]);
+                    if (restir.temporal_reuse && similar_surface(hits[z], buffers.reservoirs[pixel_index]))
+                        initial[z] = combine(hits[z], initial[z], buffers.reservoirs[pixel_index]);
+                }
+                streams[z] = current_random_stream();
+            }
+
+            // Merge in the reservoirs of random nearby pixels that saw a similar surface
+            for (int z = 0; z < pixel_count; z++) {
+                if (!resampled[z])
+                    continue;
+
+                reused[z] = initial[z];
+                int pixel_index = pixels[z];
+                current_random_stream() = streams[z];
+                for (int n = 0; n < restir.spatial_neighbors; n++) {
+                    int dx = int(std::lround((2 * random_double() - 1) * restir.spatial_radius));
+                    int dy = int(std::lround((2 * random_double() - 1) * restir.spatial_radius));
+                    int i = pixel_index % image_width + dx - tile.x;
+                    int j = pixel_index / image_width + dy - tile.y;
+                    if (i < 0 || i >= tile.width || j < 0 || j >= tile.height)
+                        continue;
+                    int q = tile_order_of[j * tile.width + i];
+                    if (q == z || !resampled[q])
+                        continue;
+                    if (!similar_surface(hits[z], initial[q]))
+                        continue;
+
+                    reused[z] = combine(hits[z], reused[z], initial[q]);
+                }
+                streams[z] = current_random_stream();
+            }
+
+            // Shade with the surviving samples and continue the paths
+            for (int z = 0; z < pixel_count; z++) {
+                int pixel_index = pixels[z];
+                surface_features first_hit;
+                surface_features* features = buffers.features.empty() ? nullptr : &first_hit;
+                current_random_stream() = streams[z];
+
+                path_state path{rays[z], color(1, 1, 1), z};
+                color radiance(0, 0, 0);
+                bool continues;
+                if (!hits[z].mat) {
+                    shade_miss(path, radiance, features);
+                    continues = false;
+                } else {
+                    continues = shade_hit(path, hits[z], radiance, world, features, resampled[z] ? &reused[z] : nullptr);
+                }
+
+                for (int depth = max_depth - 1; continues && depth > 0; depth--)
+                    continues = trace_segment(path, radiance, world);
+                finish_path(path);
+
+                staged[z] += colorf(radiance);
+                if (features)
+                    buffers.features.add(pixel_index, first_hit);
+                if (resampled[z])
+                    buffers.reservoirs[pixel_index] = reused[z];
+            }
+        }
+    }
+
+    // Streams restir.candidates light tree samples into a new reservoir for the hit
+    reservoir initial_reservoir(const hit_record& rec) const {
+        reservoir r;
+        for (int i = 0; i < restir.candidates; i++) {
+            light_sample candidate;
+            double pmf;
+            if (!lights.sample(rec.p, rec.normal, random_double(), candidate.light, pmf)) {
+                r.count += 1;
+                continue;
+            }
+
+            const light_emitter& light = lights.emitter(candidate.light);
+            candidate.point = light.sample_point(random_double(), random_double());
+
+            // Candidates are weighted by target over source density, both per unit area of emitter
+            double source_pdf = pmf / light.area;
+            r.update(candidate, luminance(unshadowed_light(rec, candidate)) / source_pdf, random_double());
+        }
+
+        r.finalize(luminance(unshadowed_light(rec, r.sample)));
+        r.surface_point = rec.p;
+        r.surface_normal = rec.normal;
+        return r;
+    }
+
+    // Merges other into r, re-evaluating other's sample at this hit
+    reservoir combine(const hit_record& rec, const reservoir& r, reservoir other) const {
+        // Keep old reservoirs from outweighing fresh candidates forever
+        other.count = std::min(other.count, double(restir.history_limit * restir.candidates));
+
+        reservoir combined;
+        combined.merge(r, luminance(unshadowed_light(rec, r.sample)), random_double());
+        combined.merge(other, luminance(unshadowed_light(rec, other.sample)), random_double());
+        combined.finalize(luminance(unshadowed_light(rec, combined.sample)));
+        combined.surface_point = rec.p;
+        combined.surface_normal = rec.normal;
+        return combined;
+    }
+
+    // Whether the reservoir was built for a surface close enough to the hit to share its samples
+    bool similar_surface(const hit_record& rec, const reservoir& r) const {
+        if (r.count <= 0)
+            return false;
+
+        double depth = (rec.p - center).length();
+        return dot(rec.normal, r.surface_normal) >= restir.normal_threshold &&
+               std::fabs((r.surface_point - center).length() - depth) <= restir.depth_threshold * depth;
+    }
+
+    // Light a sample would send to the hit if nothing is in the way: BSDF * cosine * emission *
+    // geometry term. Its luminance is the target function resampling aims for.
+    color unshadowed_light(const hit_record& rec, const light_sample& sample) const {
+        if (sample.light < 0)
+            return color(0, 0, 0);
+
+        const light_emitter& light = lights.emitter(sample.light);
+        vec3 to_light = sample.point - rec.p;
+        double distance_squared = to_light.length_squared();
+        vec3 wi = to_light / std::sqrt(distance_squared);
+
+        double cos_light = dot(light.normal, -wi);
+        if (cos_light <= 0)
+            return color(0, 0, 0);
+
+        return rec.mat->eval(rec, wi) * light.emission * (cos_light / distance_squared);
+    }
+
+    // Direct light from the reservoir's surviving sample, the only one that gets a shadow ray
+    color resampled_emitters(const hit_record& rec, const reservoir& r, const hittable& world) const {
+        color light = unshadowed_light(rec, r.sample);
+        if (r.W <= 0 || light.near_zero())
+            return color(0, 0, 0);
+
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_ray();
+
+        vec3 to_light = r.sample.point - rec.p;
+        double distance = to_light.length();
+        hit_record shadow_rec;
+        if (world.hit(ray(rec.p, to_light / distance), interval(0.001, distance - 0.001), shadow_rec))
+            return color(0, 0, 0);
+
+        return r.W * light;
+    }
+
+    void print_traversal_stats(high_resolution_clock::duration render_time) const {
+        double rays = double(traversal_stats::total_rays);
+        double visits = double(traversal_stats::total_node_visits);
+        double seconds = duration_cast<duration<double>>(render_time).count();
+        if (rays == 0 || seconds == 0)
+            return;
+
+        std::clog << "-Rays: " << rays / 1e6 << "M (" << rays / 1e6 / seconds << " Mrays/s)\n";
+        std::clog << "-Node visits per ray: " << visits / rays << "\n";
+        std::clog << "-Node cache hit rate: " << 100.0 * traversal_stats::total_node_cache_hits / std::max(visits, 1.0) << "%\n";
+        std::clog << "-Camera rays: " << 100.0 * traversal_stats::total_primary_rays / rays << "% of rays, "
+                  << 100.0 * traversal_stats::total_primary_node_visits / std::max(visits, 1.0) << "% of node visits\n";
+
+        double lookups = double(traversal_stats::total_radiance_cache_lookups);
+        if (lookups > 0)
+            std::clog << "-Radiance cache hit rate: " << 100.0 * traversal_stats::total_radiance_cache_hits / lookups << "%\n";
+    }
+
+    void print_framebuffer_stats() const {
+        double lines = double(framebuffer_stats::total_lines);
+        double scanline_lines = double(framebuffer_stats::total_scanline_lines);
+        if (lines == 0 || scanline_lines == 0)
+            return;
+
+        std::clog << "-Framebuffer lines written: " << lines / 1e6 << "M, " << 100.0 * framebuffer_stats::total_shared_lines / lines
+                  << "% shared with other tiles (" << 100.0 * framebuffer_stats::total_scanline_shared_lines / scanline_lines
+                  << "% in scanline order)\n";
+    }
+
     ray get_ray(int i, int j) const {
         // Construct a camera ray originating from the defocus disk and directed at a randomly
         // sampled point around the pixel location i, j.
 
         auto offset = sample_square();
+        if (defocus_angle <= 0)
+            return camera_ray(i, j, offset, 0, 0);
+
+        double u1 = random_double();
+        double u2 = random_double();
+        double disk_x, disk_y;
+        concentric_disk(u1, u2, disk_x, disk_y);
+        return camera_ray(i, j, offset, disk_x, disk_y);
+    }
+
+    // The ray through offset from the center of pixel i, j, starting at disk_x, disk_y on the
+    // defocus disk
+    ray camera_ray(int i, int j, const vec3& offset, double disk_x, double disk_y) const {
         auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
 
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? center : center + (disk_x * defocus_disk_u) + (disk_y * defocus_disk_v);
         auto ray_direction = unit_vector(pixel_sample - ray_origin);
 
         return ray(ray_origin, ray_direction);
@@ -146,30 +1113,357 @@ class camera {
         return vec3(random_double() - 0.5, random_double() - 0.5, 0);
     }
 
-    point3 defocus_disk_sample() const {
-        // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
-        return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
-    }
+    color ray_color(const ray& r, int depth, const hittable& world, surface_features* first_hit = nullptr) const {
+        path_state path{r, color(1, 1, 1), 0};
+        color radiance(0, 0, 0);
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
-            return color(0, 0, 0);
+            return radiance;
+
+        trace_primary(path, radiance, world, first_hit, [&](const path_state& branch) {
+            continue_camera_path(branch, depth, radiance, world);
+        });
+
+        return radiance;
+    }
+
+    // Follows a path that left the first hit of a camera ray traced depth bounces deep to its end
+    void continue_camera_path(path_state path, int depth, color& radiance, const hittable& world) const {
+        for (int d = depth - 1; d > 0; d--) {
+            if (!trace_segment(path, radiance, world))
+                break;
+        }
+        finish_path(path);
+    }
+
+    // Traces the camera ray of path once and shades its first hit for each of the paths split off
+    // there, each weighted by one over the split count. Branches that continue are handed to
+    // continue_branch, the rest are finished here.
+    template <typename ContinueBranch>
+    void trace_primary(
+        const path_state& path, color& radiance, const hittable& world, surface_features* first_hit,
+        const ContinueBranch& continue_branch) const {
+        if (TRAVERSAL_STATS_ENABLED) {
+            local_traversal_stats().primary = true;
+            local_traversal_stats().record_ray();
+        }
 
         hit_record rec;
+        bool hit = world.hit(path.r, interval(0.001, infinity), rec);
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().primary = false;
 
-        if (world.hit(r, interval(0.001, infinity), rec)) {
-            ray scattered;
-            color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth - 1, world);
-            return color(0, 0, 0);
+        shade_primary(path, hit ? &rec : nullptr, radiance, world, first_hit, continue_branch);
+    }
+
+    // The shading half of trace_primary, for a camera ray whose first hit rec is already known, or
+    // nullptr if it missed
+    template <typename ContinueBranch>
+    void shade_primary(
+        const path_state& path, const hit_record* hit, color& radiance, const hittable& world, surface_features* first_hit,
+        const ContinueBranch& continue_branch) const {
+        if (!hit) {
+            path_state missed = path;
+            shade_miss(missed, radiance, first_hit);
+            finish_path(missed);
+            return;
+        }
+
+        const hit_record& rec = *hit;
+
+        // Branches draw from streams of their own, so a branch continued later doesn't reuse the
+        // numbers the next one's bounce took
+        int splits = split_count(rec);
+        random_stream parent = current_random_stream();
+        for (int i = 0; i < splits; i++) {
+            if (splits > 1)
+                current_random_stream() = parent.branch(i);
+
+            path_state branch = path;
+            branch.throughput = path.throughput / splits;
+            if (shade_hit(branch, rec, radiance, world, i == 0 ? first_hit : nullptr))
+                continue_branch(branch);
+            else
+                finish_path(branch);
+        }
+    }
+
+    // Number of paths to split off at a camera ray's first hit. Smooth metal and glass send every
+    // branch the same way, so adaptive splitting saves them the work.
+    int split_count(const hit_record& rec) const {
+        int splits = std::max(primary_split, 1);
+        if (adaptive_split)
+            splits = std::max(1, int(std::lround(splits * rec.mat->roughness())));
+        return splits;
+    }
+
+    // Follows the path to its next hit. Adds any light the path gathers to radiance and returns
+    // false when the path has ended, or continues the path along the scattered ray and returns true.
+    // Describes the hit in first_hit when it is given.
+    bool trace_segment(path_state& path, color& radiance, const hittable& world, surface_features* first_hit = nullptr) const {
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_ray();
+
+        hit_record rec;
+
+        if (!world.hit(path.r, interval(0.001, infinity), rec)) {
+            shade_miss(path, radiance, first_hit);
+            return false;
+        }
+
+        return shade_hit(path, rec, radiance, world, first_hit);
+    }
+
+    void shade_miss(path_state& path, color& radiance, surface_features* first_hit) const {
+        if (first_hit)
+            *first_hit = {color(1, 1, 1), vec3(0, 0, 0), feature_buffers::MISS_DEPTH};
+
+        if (!caustic_from_photons(path))
+            gather(path, radiance, escaped_radiance(path));
+    }
+
+    // Whether light the path reaches now was already counted by the photon map, because the path
+    // got here through metal or glass from a diffuse bounce that gathered caustics
+    bool caustic_from_photons(const path_state& path) const {
+        return path.caustics_gathered && path.specular_since_diffuse;
+    }
+
+    // Adds light reaching the path's current vertex to the pixel
+    void gather(path_state& path, color& radiance, const color& light) const {
+        color contribution = path.throughput * light;
+        radiance += contribution;
+        path.gathered += contribution;
+    }
+
+    // Gathers light at the path's hit and scatters it. Direct light from emitters comes from the
+    // resampled reservoir when one is given, otherwise from a fresh light tree sample.
+    bool shade_hit(
+        path_state& path, const hit_record& rec, color& radiance, const hittable& world,
+        surface_features* first_hit, const reservoir* resampled = nullptr) const {
+        if (first_hit)
+            *first_hit = {rec.mat->albedo_at(rec), rec.normal, rec.t * path.r.direction().length()};
+
+        if (rec.mat->is_emissive() && !caustic_from_photons(path))
+            gather(path, radiance, emitted_radiance(path, rec));
+
+        bool diffuse = rec.mat->is_diffuse();
+        if (diffuse && radiance_caching && use_radiance_cache(path, rec, radiance))
+            return false;
+
+        if (diffuse && caustic_photons)
+            gather(path, radiance, caustics.estimate(rec));
+
+        const path_guide::distribution* guided = path_guiding && diffuse ? guide.find(rec.p) : nullptr;
+        if (diffuse && resampled)
+            gather(path, radiance, resampled_emitters(rec, *resampled, world));
+        else if (diffuse && next_event_estimation)
+            gather(path, radiance, sample_emitters(rec, world, guided));
+
+        if (diffuse && next_event_estimation)
+            gather(path, radiance, sample_environment(rec, world, guided));
+
+        ray scattered;
+        color attenuation;
+        if (guided) {
+            if (!guided_scatter(path.r, rec, *guided, attenuation, scattered))
+                return false;
+        } else if (!rec.mat->scatter(path.r, rec, attenuation, scattered)) {
+            return false;
+        }
+
+        vec3 wi = unit_vector(scattered.direction());
+        path.scatter_pdf = diffuse ? sampling_pdf(rec, wi, guided) : 0;
+        path.scatter_point = rec.p;
+        path.scatter_normal = rec.normal;
+        path.emitters_resampled = diffuse && resampled;
+        if (diffuse) {
+            path.diffuse_bounces++;
+            path.caustics_gathered = caustic_photons;
+            path.specular_since_diffuse = false;
+        } else if (rec.mat->is_specular()) {
+            path.specular_since_diffuse = true;
+        }
+        path.throughput = path.throughput * attenuation;
+        path.r = scattered;
+
+        // Remember the bounce so the guide can learn what the path finds past it
+        double scale = luminance(path.throughput) * path.scatter_pdf;
+        if (path_guiding && diffuse && scale > 0 && path.guide_vertex_count < path_state::MAX_GUIDE_VERTICES)
+            path.guide_vertices[path.guide_vertex_count++] = {
+                guide.training_cell(rec.p), path_guide::direction_bin(wi), 1 / scale, luminance(path.gathered)};
+
+        return true;
+    }
+
+    // Picks the bounce direction from the path guide or the BSDF, weighting by the mixture of both
+    // densities. The BSDF half relies on scatter() drawing its directions with exactly the density
+    // scatter_pdf() reports, bump mapped surfaces included, or the mixture weights are wrong.
+    bool guided_scatter(
+        const ray& r_in, const hit_record& rec, const path_guide::distribution& guided,
+        color& attenuation, ray& scattered) const {
+        vec3 wi;
+        if (random_double() < guide.guided_fraction) {
+            wi = path_guide::sample(guided);
+        } else {
+            if (!rec.mat->scatter(r_in, rec, attenuation, scattered))
+                return false;
+            wi = unit_vector(scattered.direction());
+        }
+
+        double pdf = sampling_pdf(rec, wi, &guided);
+        color f = rec.mat->eval(rec, wi);
+        if (pdf <= 0 || f.near_zero())
+            return false;
+
+        attenuation = f / pdf;
+        scattered = ray(rec.p, wi);
+        return true;
+    }
+
+    // Solid angle density a diffuse bounce at rec picks the unit direction wi with
+    double sampling_pdf(const hit_record& rec, const vec3& wi, const path_guide::distribution* guided) const {
+        double bsdf_pdf = rec.mat->scatter_pdf(rec, wi);
+        if (!guided)
+            return bsdf_pdf;
+
+        return guide.guided_fraction * path_guide::pdf(*guided, wi) + (1 - guide.guided_fraction) * bsdf_pdf;
+    }
+
+    // Ends the path with the cached light leaving the hit if the cache knows it well enough.
+    // Otherwise remembers the hit, so the cache learns what the rest of the path finds.
+    bool use_radiance_cache(path_state& path, const hit_record& rec, color& radiance) const {
+        if (path.diffuse_bounces >= cache.query_depth) {
+            if (TRAVERSAL_STATS_ENABLED)
+                local_traversal_stats().radiance_cache_lookups++;
+
+            color cached;
+            if (cache.lookup(rec.p, rec.normal, cached)) {
+                if (TRAVERSAL_STATS_ENABLED)
+                    local_traversal_stats().radiance_cache_hits++;
+                gather(path, radiance, cached);
+                return true;
+            }
+        }
+
+        if (path.cache_vertex_count < path_state::MAX_CACHE_VERTICES)
+            path.cache_vertices[path.cache_vertex_count++] = {cache.entry_for(rec.p, rec.normal), path.gathered, path.throughput};
+        return false;
+    }
+
+    // Teaches the path guide and radiance cache the light the path found past each of its
+    // diffuse bounces
+    void finish_path(const path_state& path) const {
+        for (int i = 0; i < path.guide_vertex_count; i++) {
+            const guide_vertex& vertex = path.guide_vertices[i];
+            guide.record(vertex.cell, vertex.bin, (luminance(path.gathered) - vertex.gathered) * vertex.scale);
         }
 
-        vec3 unit_direction = unit_vector(r.direction());
-        auto a = 0.5 * (unit_direction.y() + 1.0);
-        return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+        for (int i = 0; i < path.cache_vertex_count; i++) {
+            const cache_vertex& vertex = path.cache_vertices[i];
+            const color& t = vertex.throughput;
+            if (t.x() <= 0 || t.y() <= 0 || t.z() <= 0)
+                continue;
+
+            color found = path.gathered - vertex.gathered;
+            cache.record(vertex.entry, color(found.x() / t.x(), found.y() / t.y(), found.z() / t.z()));
+        }
+    }
+
+    // Environment light seen by a path that left the scene, weighted against the chance that
+    // next event estimation already sampled it at the previous hit
+    color escaped_radiance(const path_state& path) const {
+        vec3 direction = unit_vector(path.r.direction());
+        color le = background->radiance(direction);
+        if (!next_event_estimation || path.scatter_pdf <= 0)
+            return le;
+
+        return power_heuristic(path.scatter_pdf, background->pdf(direction)) * le;
+    }
+
+    // Next event estimation: samples a direction toward the environment and casts a shadow ray
+    color sample_environment(
+        const hit_record& rec, const hittable& world, const path_guide::distribution* guided = nullptr) const {
+        vec3 wi;
+        color le;
+        double light_pdf;
+        if (!background->sample(wi, le, light_pdf))
+            return color(0, 0, 0);
+
+        color f = rec.mat->eval(rec, wi);
+        if (f.near_zero())
+            return color(0, 0, 0);
+
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_ray();
+
+        hit_record shadow_rec;
+        if (world.hit(ray(rec.p, wi), interval(0.001, infinity), shadow_rec))
+            return color(0, 0, 0);
+
+        double weight = power_heuristic(light_pdf, sampling_pdf(rec, wi, guided));
+        return (weight / light_pdf) * f * le;
+    }
+
+    // Light from an emitter the path hit, weighted against the chance that next event estimation
+    // already sampled it at the previous hit
+    color emitted_radiance(const path_state& path, const hit_record& rec) const {
+        color le = rec.mat->emitted(rec);
+        int light_index = lights.find(rec.object);
+        if (path.emitters_resampled && light_index >= 0)
+            return color(0, 0, 0);
+        if (!next_event_estimation || path.scatter_pdf <= 0 || light_index < 0)
+            return le;
+
+        const light_emitter& light = lights.emitter(light_index);
+        vec3 to_light = rec.p - path.scatter_point;
+        double cos_light = std::fabs(dot(light.normal, unit_vector(to_light)));
+        if (cos_light <= 0)
+            return le;
+
+        double light_pdf = lights.pmf(path.scatter_point, path.scatter_normal, light_index) *
+                           to_light.length_squared() / (cos_light * light.area);
+        return power_heuristic(path.scatter_pdf, light_pdf) * le;
+    }
+
+    // Next event estimation: picks an emitter from the light tree, samples a point on it and casts
+    // a shadow ray
+    color sample_emitters(
+        const hit_record& rec, const hittable& world, const path_guide::distribution* guided = nullptr) const {
+        int light_index;
+        double pmf;
+        if (lights.empty() || !lights.sample(rec.p, rec.normal, random_double(), light_index, pmf))
+            return color(0, 0, 0);
+
+        const light_emitter& light = lights.emitter(light_index);
+        vec3 to_light = light.sample_point(random_double(), random_double()) - rec.p;
+        double distance = to_light.length();
+        vec3 wi = to_light / distance;
+
+        double cos_light = dot(light.normal, -wi);
+        if (cos_light <= 0)
+            return color(0, 0, 0);
+
+        color f = rec.mat->eval(rec, wi);
+        if (f.near_zero())
+            return color(0, 0, 0);
+
+        if (TRAVERSAL_STATS_ENABLED)
+            local_traversal_stats().record_ray();
+
+        hit_record shadow_rec;
+        if (world.hit(ray(rec.p, wi), interval(0.001, distance - 0.001), shadow_rec))
+            return color(0, 0, 0);
+
+        double light_pdf = pmf * distance * distance / (cos_light * light.area);
+        double weight = power_heuristic(light_pdf, sampling_pdf(rec, wi, guided));
+        return (weight / light_pdf) * f * light.emission;
+    }
+
+    static double power_heuristic(double pdf, double other_pdf) {
+        double a = pdf * pdf;
+        double b = other_pdf * other_pdf;
+        return a + b > 0 ? a / (a + b) : 0;
     }
 };
 
@@ -1,10 +1,17 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <vector>
+
 #include "../util/interval.h"
 #include "../util/vec3.h"
 
 using color = vec3;
+using colorf = vec3f;  // For sums kept per pixel, widened back to color for output
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
 
 inline double linear_to_gamma(double linear_component) {
     if (linear_component > 0)
@@ -0,0 +1,152 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../util/image.h"
+#include "../util/thread_pool.h"
+#include "../util/utils.h"
+
+// Light arriving from infinitely far away, seen by every ray that leaves the scene
+class environment {
+   public:
+    virtual ~environment() = default;
+
+    // Radiance arriving along the unit direction
+    virtual color radiance(const vec3& direction) const = 0;
+
+    // Picks a unit direction toward the environment for next event estimation. Returns false if
+    // the environment can't be sampled directly, in which case it is only found by escaping rays.
+    virtual bool sample(vec3& /*direction*/, color& /*radiance*/, double& /*pdf*/) const {
+        return false;
+    }
+
+    // Solid angle density that sample() picks the unit direction with
+    virtual double pdf(const vec3& /*direction*/) const {
+        return 0;
+    }
+};
+
+// The default blend from white at the horizon to light blue overhead
+class gradient_sky : public environment {
+   public:
+    color radiance(const vec3& direction) const override {
+        auto a = 0.5 * (direction.y() + 1.0);
+        return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+    }
+};
+
+// Equirectangular HDR image, importance sampled in proportion to its luminance
+class hdr_environment : public environment {
+   public:
+    hdr_environment(const std::string& filename, double intensity = 1.0)
+        : map(filename), intensity(intensity), width(map.get_width()), height(map.get_height()) {
+        build_distribution();
+    }
+
+    color radiance(const vec3& direction) const override {
+        int x, y;
+        direction_to_pixel(direction, x, y);
+        return intensity * map.pixel(x, y);
+    }
+
+    bool sample(vec3& direction, color& radiance, double& pdf) const override {
+        if (total_weight <= 0)
+            return false;
+
+        // Pick a row from the marginal distribution, then a column within it
+        double du, dv;
+        int y = sample_cdf(row_cdf, 0, height, random_double(), dv);
+        int x = sample_cdf(column_cdf, y * (width + 1), width, random_double(), du);
+
+        double theta = pi * (y + dv) / height;
+        double phi = 2 * pi * (x + du) / width - pi;
+        direction = vec3(std::sin(theta) * std::cos(phi), std::cos(theta), -std::sin(theta) * std::sin(phi));
+
+        pdf = pixel_pdf(x, y, std::sin(theta));
+        radiance = intensity * map.pixel(x, y);
+        return pdf > 0;
+    }
+
+    double pdf(const vec3& direction) const override {
+        if (total_weight <= 0)
+            return 0;
+
+        int x, y;
+        direction_to_pixel(direction, x, y);
+        double sin_theta = std::sqrt(std::max(0.0, 1 - direction.y() * direction.y()));
+        return pixel_pdf(x, y, sin_theta);
+    }
+
+   private:
+    static const int ROWS_PER_JOB = 16;
+
+    hdr_image map;
+    double intensity;  // Scale applied to every pixel of the map
+    int width;
+    int height;
+
+    std::vector<double> weights;     // Luminance times sin(theta) of every pixel
+    std::vector<double> row_cdf;     // Marginal distribution over rows, height + 1 entries
+    std::vector<double> column_cdf;  // Distribution over columns within each row, width + 1 entries per row
+    double total_weight = 0;
+
+    void build_distribution() {
+        weights.resize(width * height);
+        row_cdf.assign(height + 1, 0);
+        column_cdf.assign((width + 1) * height, 0);
+
+        // Rows are independent, so they are converted on the pool and only summed in order here
+        shared_thread_pool().parallel_for(0, height, ROWS_PER_JOB, [&](int first_row, int last_row) {
+            for (int y = first_row; y < last_row; y++) {
+                // Rows near the poles cover less solid angle
+                double sin_theta = std::sin(pi * (y + 0.5) / height);
+                double* cdf = &column_cdf[y * (width + 1)];
+
+                for (int x = 0; x < width; x++) {
+                    weights[y * width + x] = luminance(map.pixel(x, y)) * sin_theta;
+                    cdf[x + 1] = cdf[x] + weights[y * width + x];
+                }
+            }
+        });
+
+        for (int y = 0; y < height; y++)
+            row_cdf[y + 1] = row_cdf[y] + column_cdf[y * (width + 1) + width];
+
+        total_weight = row_cdf[height];
+    }
+
+    // Finds the bin of the unnormalized cdf that u falls in, and how far into the bin it is
+    static int sample_cdf(const std::vector<double>& cdf, int offset, int count, double u, double& remainder) {
+        auto first = cdf.begin() + offset;
+        double target = u * first[count];
+
+        int bin = int(std::upper_bound(first, first + count + 1, target) - first) - 1;
+        bin = std::clamp(bin, 0, count - 1);
+
+        double bin_weight = first[bin + 1] - first[bin];
+        remainder = bin_weight > 0 ? std::clamp((target - first[bin]) / bin_weight, 0.0, 1.0) : 0.5;
+        return bin;
+    }
+
+    void direction_to_pixel(const vec3& direction, int& x, int& y) const {
+        double theta = std::acos(std::clamp(direction.y(), -1.0, 1.0));
+        double phi = std::atan2(-direction.z(), direction.x());
+
+        x = std::clamp(int((phi + pi) / (2 * pi) * width), 0, width - 1);
+        y = std::clamp(int(theta / pi * height), 0, height - 1);
+    }
+
+    // Converts the density of picking pixel x, y from the unit square to solid angle
+    double pixel_pdf(int x, int y, double sin_theta) const {
+        if (sin_theta <= 0)
+            return 0;
+
+        double image_pdf = weights[y * width + x] / total_weight * width * height;
+        return image_pdf / (2 * pi * pi * sin_theta);
+    }
+};
+
+#endif
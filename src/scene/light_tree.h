@@ -0,0 +1,272 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "../geometry/hittable.h"
+#include "../geometry/node.h"
+#include "../geometry/tri.h"
+#include "../scene/material.h"
+#include "../util/utils.h"
+
+// Bounds the directions a group of emitters faces: every emitter normal is within theta_o of the
+// axis, and each emits up to theta_e away from its normal
+struct light_cone {
+    vec3 axis;
+    double theta_o = 0;
+    double theta_e = pi / 2;
+
+    // Smallest cone that holds both a and b
+    static light_cone merge(const light_cone& a, const light_cone& b) {
+        double theta_e = std::fmax(a.theta_e, b.theta_e);
+        double theta_d = std::acos(std::clamp(dot(a.axis, b.axis), -1.0, 1.0));
+
+        if (std::fmin(theta_d + b.theta_o, pi) <= a.theta_o)
+            return {a.axis, a.theta_o, theta_e};
+        if (std::fmin(theta_d + a.theta_o, pi) <= b.theta_o)
+            return {b.axis, b.theta_o, theta_e};
+
+        double theta_o = (a.theta_o + theta_d + b.theta_o) / 2;
+        vec3 rotation_axis = cross(a.axis, b.axis);
+        if (theta_o >= pi || rotation_axis.near_zero())
+            return {a.axis, pi, theta_e};
+
+        // Rotate a's axis toward b's so the new cone just reaches both edges
+        vec3 axis = rotate_point(a.axis, point3(0, 0, 0), (theta_o - a.theta_o) * 180 / pi, rotation_axis);
+        return {unit_vector(axis), theta_o, theta_e};
+    }
+};
+
+// An emissive triangle
+struct light_emitter {
+    const triangle* tri;
+    color emission;   // Radiance leaving the front face
+    vec3 normal;      // Unit normal of the front face
+    double area;
+    double power;     // Luminance of the total emitted flux
+
+    // Uniformly distributed point on the triangle for u1, u2 in [0,1)
+    point3 sample_point(double u1, double u2) const {
+        double su = std::sqrt(u1);
+        double b0 = 1 - su;
+        double b1 = u2 * su;
+        return b0 * tri->a + b1 * tri->b + (1 - b0 - b1) * tri->c;
+    }
+};
+
+// Hierarchy over the emitters that picks a light for a shading point in proportion to an estimate
+// of how much it contributes there (Conty & Kulla 2018), walking one root to leaf path. Split
+// along the same axes as the geometry BVH.
+class light_tree {
+   public:
+    // Gathers every emissive triangle in world and rebuilds the tree over them
+    void build(const hittable& world) {
+        std::vector<const triangle*> triangles;
+        world.collect_emitters(triangles);
+
+        emitters.clear();
+        index_of.clear();
+        for (const triangle* tri : triangles) {
+            auto* light = static_cast<const diffuse_light*>(tri->get_material());
+
+            light_emitter emitter;
+            emitter.tri = tri;
+            emitter.emission = light->emission();
+            emitter.normal = unit_vector(tri->get_normal());
+            emitter.area = tri->area();
+            emitter.power = luminance(emitter.emission) * emitter.area * pi;
+            if (emitter.power <= 0)
+                continue;
+
+            index_of[tri] = int(emitters.size());
+            emitters.push_back(emitter);
+        }
+
+        nodes.clear();
+        order.resize(emitters.size());
+        trails.assign(emitters.size(), 0);
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = int(i);
+
+        if (!emitters.empty())
+            build_node(0, int(emitters.size()), 0, 0);
+    }
+
+    bool empty() const { return emitters.empty(); }
+    size_t size() const { return emitters.size(); }
+
+    const light_emitter& emitter(int index) const { return emitters[index]; }
+
+    // Index of the emitter for a hit primitive, or -1 if it isn't in the tree
+    int find(const hittable* object) const {
+        auto it = index_of.find(object);
+        return it != index_of.end() ? it->second : -1;
+    }
+
+    // Picks an emitter for the shading point p with normal n using u in [0,1). Returns false if no
+    // emitter can light the point.
+    bool sample(const point3& p, const vec3& n, double u, int& light_index, double& pmf) const {
+        if (nodes.empty())
+            return false;
+
+        pmf = 1;
+        int current = 0;
+        while (nodes[current].child_a >= 0) {
+            const light_node& node = nodes[current];
+            double importance_a = importance(p, n, nodes[node.child_a]);
+            double importance_b = importance(p, n, nodes[node.child_b]);
+            if (importance_a + importance_b <= 0)
+                return false;
+
+            // Reuse u for the next choice by rescaling the part of [0,1) it fell in
+            double probability_a = importance_a / (importance_a + importance_b);
+            if (u < probability_a) {
+                u = std::fmin(u / probability_a, 1 - 1e-12);
+                pmf *= probability_a;
+                current = node.child_a;
+            } else {
+                u = std::fmin((u - probability_a) / (1 - probability_a), 1 - 1e-12);
+                pmf *= 1 - probability_a;
+                current = node.child_b;
+            }
+        }
+
+        // Leaves only hold emitters that couldn't be split apart, choose between them by power
+        const light_node& leaf = nodes[current];
+        double target = u * leaf.power;
+        light_index = order[leaf.first];
+        for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+            light_index = order[i];
+            target -= emitters[light_index].power;
+            if (target < 0)
+                break;
+        }
+
+        pmf *= emitters[light_index].power / leaf.power;
+        return true;
+    }
+
+    // Probability that sample() picks the emitter for the shading point p with normal n
+    double pmf(const point3& p, const vec3& n, int light_index) const {
+        if (light_index < 0 || nodes.empty())
+            return 0;
+
+        double pmf = 1;
+        int current = 0;
+        uint64_t trail = trails[light_index];
+        while (nodes[current].child_a >= 0) {
+            const light_node& node = nodes[current];
+            double importance_a = importance(p, n, nodes[node.child_a]);
+            double importance_b = importance(p, n, nodes[node.child_b]);
+            if (importance_a + importance_b <= 0)
+                return 0;
+
+            bool take_b = trail & 1;
+            pmf *= (take_b ? importance_b : importance_a) / (importance_a + importance_b);
+            current = take_b ? node.child_b : node.child_a;
+            trail >>= 1;
+        }
+
+        return pmf * emitters[light_index].power / nodes[current].power;
+    }
+
+   private:
+    struct light_node {
+        bounding_box bounds;
+        light_cone cone;
+        double power = 0;  // Sum of the power of every emitter below
+        int first = 0;     // First emitter below, as an index into order
+        int count = 0;     // Number of emitters below
+        int child_a = -1;  // Child node indices, -1 for leaves
+        int child_b = -1;
+    };
+
+    static const int MAX_SPLIT_DEPTH = 32;  // Keeps every bit trail within 64 bits
+
+    std::vector<light_emitter> emitters;
+    std::unordered_map<const hittable*, int> index_of;  // Emitter index of each emissive triangle
+    std::vector<int> order;                             // Emitter indices, grouped so each node covers a range
+    std::vector<uint64_t> trails;                       // Left/right choices from the root to each emitter, root first
+    std::vector<light_node> nodes;                      // Root first
+
+    int build_node(int first, int count, int depth, uint64_t trail) {
+        light_node node;
+        node.first = first;
+        node.count = count;
+
+        const light_emitter& head = emitters[order[first]];
+        node.bounds = head.tri->get_bounds();
+        node.cone = {head.normal, 0, pi / 2};
+        for (int i = first; i < first + count; i++) {
+            const light_emitter& emitter = emitters[order[i]];
+            node.bounds.expand_to_contain(emitter.tri->get_bounds());
+            node.cone = light_cone::merge(node.cone, {emitter.normal, 0, pi / 2});
+            node.power += emitter.power;
+        }
+
+        int index = int(nodes.size());
+        nodes.push_back(node);
+
+        int axis = -1;
+        std::vector<int> range(order.begin() + first, order.begin() + first + count);
+        if (count > 1 && depth < MAX_SPLIT_DEPTH)
+            axis = choose_split_axis(node.bounds, range, [this](int light) {
+                return emitters[light].tri->origin;
+            });
+
+        if (axis == -1) {
+            for (int i = first; i < first + count; i++)
+                trails[order[i]] = trail;
+            return index;
+        }
+
+        double splitPoint = (node.bounds.min[axis] + node.bounds.max[axis]) / 2;
+        auto middle = std::partition(order.begin() + first, order.begin() + first + count, [&](int light) {
+            return emitters[light].tri->origin[axis] < splitPoint;
+        });
+        int count_a = int(middle - (order.begin() + first));
+
+        int child_a = build_node(first, count_a, depth + 1, trail);
+        int child_b = build_node(first + count_a, count - count_a, depth + 1, trail | (uint64_t(1) << depth));
+        nodes[index].child_a = child_a;
+        nodes[index].child_b = child_b;
+        return index;
+    }
+
+    // Estimate of the light a node can send to the shading point p with normal n: its power over
+    // the squared distance, scaled by the best case angles its cone and bounds allow
+    static double importance(const point3& p, const vec3& n, const light_node& node) {
+        point3 center = 0.5 * (node.bounds.min + node.bounds.max);
+        double radius_squared = 0.25 * (node.bounds.max - node.bounds.min).length_squared();
+        double distance_squared = std::fmax((p - center).length_squared(), radius_squared);
+
+        // Angle the bounds subtend seen from p, everything when p is inside them
+        double theta_b = pi;
+        if ((p - center).length_squared() > radius_squared)
+            theta_b = std::asin(std::sqrt(radius_squared / (p - center).length_squared()));
+
+        // How close to the cone the direction from the lights to p can get
+        vec3 wi = unit_vector(p - center);
+        double theta_w = std::acos(std::clamp(dot(node.cone.axis, wi), -1.0, 1.0));
+        double theta_p = std::fmax(0.0, theta_w - node.cone.theta_o - theta_b);
+        if (theta_p >= node.cone.theta_e)
+            return 0;
+
+        // And how close to the receiver normal the direction from p to the lights can get
+        double cos_receiver = 1;
+        if (!n.near_zero()) {
+            double theta_i = std::acos(std::clamp(dot(n, -wi), -1.0, 1.0));
+            double theta_ip = std::fmax(0.0, theta_i - theta_b);
+            if (theta_ip >= pi / 2)
+                return 0;
+            cos_receiver = std::cos(theta_ip);
+        }
+
+        return node.power * std::cos(theta_p) * cos_receiver / distance_squared;
+    }
+};
+
+#endif
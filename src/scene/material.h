@@ -2,6 +2,7 @@
 #define MATERIAL_H
 
 #include <map>
+#include <mutex>
 #include <optional>
 
 #include "../geometry/hittable.h"
@@ -15,61 +16,99 @@ class material {
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
         return false;
     }
+
+    // Diffuse materials can be lit directly by sampling lights. The rest only find light by
+    // scattering into it.
+    virtual bool is_diffuse() const {
+        return false;
+    }
+
+    // BSDF times the cosine term for light arriving from the unit direction wi
+    virtual color eval(const hit_record& /*rec*/, const vec3& /*wi*/) const {
+        return color(0, 0, 0);
+    }
+
+    // Solid angle density scatter() picks the unit direction wi with
+    virtual double scatter_pdf(const hit_record& /*rec*/, const vec3& /*wi*/) const {
+        return 0;
+    }
+
+    // Surface color at the hit, used as a denoiser feature
+    virtual color albedo_at(const hit_record& /*rec*/) const {
+        return color(0, 0, 0);
+    }
+
+    // Emissive materials are gathered into the light tree and sampled directly
+    virtual bool is_emissive() const {
+        return false;
+    }
+
+    // Metal and glass redirect light without spreading it out, focusing it into caustics
+    bool is_specular() const {
+        return !is_diffuse() && !is_emissive();
+    }
+
+    // How widely the surface spreads the light it scatters, from 0 for mirrors and glass to 1 for
+    // diffuse surfaces
+    virtual double roughness() const {
+        return is_diffuse() ? 1 : 0;
+    }
+
+    // Radiance the surface emits toward the ray that hit it
+    virtual color emitted(const hit_record& /*rec*/) const {
+        return color(0, 0, 0);
+    }
 };
 
+// Cosine-weighted diffuse reflection, which is what sample_cosine_hemisphere() produces
+inline color lambert_eval(const color& albedo, const vec3& normal, const vec3& wi) {
+    return albedo * (std::fmax(0.0, dot(normal, wi)) / pi);
+}
+
+inline double lambert_pdf(const vec3& normal, const vec3& wi) {
+    return std::fmax(0.0, dot(normal, wi)) / pi;
+}
+
 class lambertian : public material {
    public:
     lambertian(const color& albedo) : albedo(albedo) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
         const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
-
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
-
-        scattered = ray(rec.p, scatter_direction);
+        scattered = ray(rec.p, sample_cosine_hemisphere(rec.normal, random_double(), random_double()));
         attenuation = albedo;
         return true;
     }
 
+    bool is_diffuse() const override {
+        return true;
+    }
+
+    color eval(const hit_record& rec, const vec3& wi) const override {
+        return lambert_eval(albedo, rec.normal, wi);
+    }
+
+    double scatter_pdf(const hit_record& rec, const vec3& wi) const override {
+        return lambert_pdf(rec.normal, wi);
+    }
+
+    color albedo_at(const hit_record& /*rec*/) const override {
+        return albedo;
+    }
+
    private:
     color albedo;
 };
 
 class texture_lambertian : public material {
    public:
+    // Without a texture until set_texture is called, so the file can be decoded on another thread
+    texture_lambertian() {}
     texture_lambertian(const std::string& texture_file) : texture(texture_file) {}
     texture_lambertian(const std::string& texture_file, const std::string& normal_file) : texture(texture_file), normal_texture(normal_file) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-        if (!normal_texture.has_value()) {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
-
-            // Catch degenerate scatter direction
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
-
-            scattered = ray(rec.p, scatter_direction);
-
-            // Sample the texture at the UV coordinates
-            attenuation = texture.sample(rec.u, rec.v);
-
-            return true;
-        }
-
-        // Use normal texture for bump mapping
-        vec3 normal = normal_texture->sample(rec.u, rec.v);
-        normal = unit_vector(normal * 2.0 - vec3(1.0, 1.0, 1.0));  // Convert to [-1, 1] range
-        vec3 scatter_direction = rec.normal + (normal * 1) + random_unit_vector();
-        scatter_direction = unit_vector(scatter_direction);
-
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
-
-        scattered = ray(rec.p, scatter_direction);
+        scattered = ray(rec.p, sample_cosine_hemisphere(shading_normal(rec), random_double(), random_double()));
 
         // Sample the texture at the UV coordinates
         attenuation = texture.sample(rec.u, rec.v);
@@ -77,32 +116,125 @@ class texture_lambertian : public material {
         return true;
     }
 
+    void set_texture(const std::string& texture_file) {
+        texture = image(texture_file);
+    }
+
     void set_normal(const std::string& normal_file) {
         normal_texture = image(normal_file);
     }
 
+    bool is_diffuse() const override {
+        return true;
+    }
+
+    // Lambertian around the bump mapped normal, the same one scatter() samples around
+    color eval(const hit_record& rec, const vec3& wi) const override {
+        return lambert_eval(texture.sample(rec.u, rec.v), shading_normal(rec), wi);
+    }
+
+    double scatter_pdf(const hit_record& rec, const vec3& wi) const override {
+        return lambert_pdf(shading_normal(rec), wi);
+    }
+
+    color albedo_at(const hit_record& rec) const override {
+        return texture.sample(rec.u, rec.v);
+    }
+
    private:
     image texture;
     // Optional normal texture for bump mapping
     std::optional<image> normal_texture;
+
+    // The surface normal tilted by the normal texture, if there is one
+    vec3 shading_normal(const hit_record& rec) const {
+        if (!normal_texture.has_value())
+            return rec.normal;
+
+        vec3 normal = normal_texture->sample(rec.u, rec.v);
+        normal = unit_vector(normal * 2.0 - vec3(1.0, 1.0, 1.0));  // Convert to [-1, 1] range
+        vec3 tilted = rec.normal + normal;
+
+        // Catch a normal texture pointing straight against the surface
+        if (tilted.near_zero())
+            return rec.normal;
+        return unit_vector(tilted);
+    }
 };
 
 class metal : public material {
    public:
     metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
+    // Reflects off a microfacet normal drawn from the GGX distribution, so rougher metal blurs the
+    // reflection more. A fuzz of 0 is a perfect mirror.
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
         const override {
-        vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        scattered = ray(rec.p, reflected);
-        attenuation = albedo;
-        return dot(scattered.direction(), rec.normal) > 0;
+        vec3 wo = -unit_vector(r_in.direction());
+        vec3 h = sample_ggx_normal(rec.normal, alpha(), random_double(), random_double());
+        vec3 wi = reflect(-wo, h);
+        scattered = ray(rec.p, wi);
+
+        double cos_o = dot(rec.normal, wo);
+        double cos_i = dot(rec.normal, wi);
+        if (cos_o <= 0 || cos_i <= 0)
+            return false;
+
+        // eval() over scatter_pdf(), in which the distribution of microfacets cancels out
+        attenuation = albedo * (ggx_shadowing(cos_o, cos_i) * dot(wo, h) / (cos_o * dot(rec.normal, h)));
+        return true;
+    }
+
+    color eval(const hit_record& rec, const vec3& wi) const override {
+        vec3 wo = -unit_vector(rec.incoming);
+        double cos_o = dot(rec.normal, wo);
+        double cos_i = dot(rec.normal, wi);
+        if (cos_o <= 0 || cos_i <= 0 || alpha() <= 0)
+            return color(0, 0, 0);
+
+        vec3 h = unit_vector(wo + wi);
+        double distribution = ggx_pdf(alpha(), dot(rec.normal, h)) / dot(rec.normal, h);
+        return albedo * (distribution * ggx_shadowing(cos_o, cos_i) / (4 * cos_o));
+    }
+
+    // Density of the microfacet normal, changed to the density of the direction it reflects into.
+    // A mirror reflects into a single direction, which no other sampling strategy can hit.
+    double scatter_pdf(const hit_record& rec, const vec3& wi) const override {
+        vec3 wo = -unit_vector(rec.incoming);
+        if (dot(rec.normal, wi) <= 0 || alpha() <= 0)
+            return 0;
+
+        vec3 h = unit_vector(wo + wi);
+        return ggx_pdf(alpha(), dot(rec.normal, h)) / (4 * std::fabs(dot(wo, h)));
+    }
+
+    color albedo_at(const hit_record& /*rec*/) const override {
+        return albedo;
+    }
+
+    double roughness() const override {
+        return fuzz;
     }
 
    private:
     color albedo;
     double fuzz;
+
+    // GGX roughness that spreads reflections about as far as moving them by up to fuzz did
+    double alpha() const {
+        return fuzz / 2;
+    }
+
+    // Share of microfacets both seen from the outgoing and lit from the incoming direction, by
+    // Smith's separable approximation
+    double ggx_shadowing(double cos_o, double cos_i) const {
+        return ggx_masking(cos_o) * ggx_masking(cos_i);
+    }
+
+    double ggx_masking(double cos_theta) const {
+        double tan_squared = std::fmax(0.0, 1 - cos_theta * cos_theta) / (cos_theta * cos_theta);
+        return 2 / (1 + std::sqrt(1 + alpha() * alpha() * tan_squared));
+    }
 };
 
 class dielectric : public material {
@@ -130,6 +262,10 @@ class dielectric : public material {
         return true;
     }
 
+    color albedo_at(const hit_record& /*rec*/) const override {
+        return color(1.0, 1.0, 1.0);
+    }
+
    private:
     // Refractive index in vacuum or air, or the ratio of the material's refractive index over
     // the refractive index of the enclosing media
@@ -143,24 +279,59 @@ class dielectric : public material {
     }
 };
 
+// Emits light from its front face and doesn't reflect any
+class diffuse_light : public material {
+   public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    bool is_emissive() const override {
+        return true;
+    }
+
+    color emitted(const hit_record& rec) const override {
+        return rec.front_face ? emit : color(0, 0, 0);
+    }
+
+    color albedo_at(const hit_record& /*rec*/) const override {
+        return emit;
+    }
+
+    const color& emission() const {
+        return emit;
+    }
+
+   private:
+    color emit;
+};
+
+// Materials by name. Files may be loaded on several threads at once, so additions and lookups
+// take MATERIALS_MUTEX. Triangles hold on to the entry of their material's name, made empty if
+// nothing was added under it yet, so a hit costs a pointer read rather than a lookup. Entries of
+// a std::map never move.
+std::mutex MATERIALS_MUTEX;
 std::map<std::string, shared_ptr<material>> MATERIALS = {
     {"missing_texture", make_shared<lambertian>(color(1, 0, 1))},
     // Add more materials here as needed.
 };
 
-inline shared_ptr<material> get_material(const std::string& name) {
-    // Returns the material with the given name, or the missing texture material if not found.
-    auto it = MATERIALS.find(name);
-    if (it != MATERIALS.end())
-        return it->second;
+// Entry of name in MATERIALS, empty until a material is added under it
+inline const shared_ptr<material>* material_slot(const std::string& name) {
+    std::unique_lock<std::mutex> lock(MATERIALS_MUTEX);
+    return &MATERIALS[name];
+}
 
-    return MATERIALS["missing_texture"];
+// Material of an entry, or the missing texture material if the entry is still empty
+inline const material* material_in(const shared_ptr<material>* slot) {
+    static const material* missing = material_slot("missing_texture")->get();
+    return *slot ? slot->get() : missing;
 }
 
 inline void add_material(const std::string& name, shared_ptr<material> mat) {
     // Adds a material to the MATERIALS map.
-    if (MATERIALS.find(name) == MATERIALS.end()) {
-        MATERIALS[name] = mat;
+    std::unique_lock<std::mutex> lock(MATERIALS_MUTEX);
+    shared_ptr<material>& entry = MATERIALS[name];
+    if (!entry) {
+        entry = mat;
     } else {
         std::cerr << "Material with name '" << name << "' already exists. Skipping addition.\n";
     }
@@ -0,0 +1,151 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../util/spatial_hash.h"
+#include "../util/utils.h"
+
+// A diffuse bounce waiting for its path to finish so the light found past it can be learned
+struct guide_vertex {
+    int cell;         // Training cell of the bounce, -1 if the table had no room
+    int bin;          // Direction bin the path left the bounce through
+    double scale;     // One over the luminance of the path throughput after the bounce times its pdf
+    double gathered;  // Luminance the path had gathered when it left the bounce
+};
+
+// Learns where indirect light comes from while rendering, so diffuse bounces can be aimed at it.
+// Space is split into a hashed grid of cells, and each cell keeps a histogram of the radiance
+// arriving over the sphere of directions in equal-area bins (cos theta by phi). Workers add the
+// radiance their finished paths found into the training histograms with atomic adds, and between
+// passes the training histograms are turned into the read-only distributions that get sampled.
+class path_guide {
+   public:
+    static const int THETA_BINS = 8;
+    static const int PHI_BINS = 16;
+    static const int BINS = THETA_BINS * PHI_BINS;
+
+    double cell_size = 0.5;         // Edge length of a grid cell in world units
+    double guided_fraction = 0.5;   // Share of diffuse bounces that sample the guide instead of the BSDF
+    int training_passes = 4;        // Leading passes of 1, 2, 4... samples used to learn before the rest
+    int min_cell_records = 16;      // Records a cell needs before it is trusted for sampling
+    int table_bits = 14;            // The grid hashes into 2^table_bits cells
+
+    // A cell's learned distribution, ready to sample
+    struct distribution {
+        std::array<float, BINS + 1> cdf;  // Normalized running sum over the bins, cdf[0] = 0
+        int last_bin;                     // Last bin with any weight
+    };
+
+    // Clears everything learned, sizing the tables for table_bits
+    void reset() {
+        cells.reset(table_bits);
+        size_t cell_count = cells.size();
+        records = std::make_unique<std::atomic<uint32_t>[]>(cell_count);
+        histograms = std::make_unique<std::atomic<float>[]>(cell_count * BINS);
+        for (size_t i = 0; i < cell_count; i++)
+            records[i] = 0;
+        for (size_t i = 0; i < cell_count * BINS; i++)
+            histograms[i] = 0;
+
+        distributions.clear();
+        distribution_of.assign(cell_count, -1);
+    }
+
+    // Turns the training histograms into the distributions find() returns. Must not run while
+    // workers are rendering.
+    void update_distributions() {
+        distributions.clear();
+        for (size_t cell = 0; cell < distribution_of.size(); cell++) {
+            distribution_of[cell] = -1;
+            if (records[cell] < uint32_t(min_cell_records))
+                continue;
+
+            distribution d;
+            d.cdf[0] = 0;
+            for (int bin = 0; bin < BINS; bin++)
+                d.cdf[bin + 1] = d.cdf[bin] + histograms[cell * BINS + bin];
+
+            float total = d.cdf[BINS];
+            if (!(total > 0))
+                continue;
+            for (float& value : d.cdf)
+                value /= total;
+            d.last_bin = BINS - 1;
+            while (d.last_bin > 0 && d.cdf[d.last_bin + 1] <= d.cdf[d.last_bin])
+                d.last_bin--;
+
+            distribution_of[cell] = int(distributions.size());
+            distributions.push_back(d);
+        }
+    }
+
+    // The distribution for the cell containing p, or nullptr if the cell hasn't learned enough
+    const distribution* find(const point3& p) const {
+        int cell = cells.find(grid_key(p, cell_size));
+        if (cell < 0 || distribution_of[cell] < 0)
+            return nullptr;
+        return &distributions[distribution_of[cell]];
+    }
+
+    // Training cell for p, claiming a new one if needed. -1 if the table is full around it.
+    int training_cell(const point3& p) const {
+        return cells.claim(grid_key(p, cell_size));
+    }
+
+    // Adds radiance arriving at the training cell through the direction bin, already divided by
+    // the density its direction was sampled with. Safe to call from any number of workers at once.
+    void record(int cell, int bin, double radiance) const {
+        if (cell < 0 || !(radiance >= 0) || !std::isfinite(radiance))
+            return;
+
+        atomic_add(histograms[size_t(cell) * BINS + bin], float(radiance));
+        records[cell]++;
+    }
+
+    static int direction_bin(const vec3& wi) {
+        int theta_bin = std::clamp(int((wi.y() + 1) / 2 * THETA_BINS), 0, THETA_BINS - 1);
+        double phi = std::atan2(wi.z(), wi.x());
+        if (phi < 0)
+            phi += 2 * pi;
+        int phi_bin = std::clamp(int(phi / (2 * pi) * PHI_BINS), 0, PHI_BINS - 1);
+        return theta_bin * PHI_BINS + phi_bin;
+    }
+
+    // Picks a unit direction from the distribution
+    static vec3 sample(const distribution& d) {
+        double u = random_double();
+        // u only runs past the last bin with weight when it rounds to the float total, and
+        // belongs to that bin then
+        int bin = int(std::upper_bound(d.cdf.begin(), d.cdf.end(), float(u)) - d.cdf.begin()) - 1;
+        bin = std::min(bin, d.last_bin);
+
+        // Bins are equal area, so uniform within the bin's cos theta and phi ranges is uniform in
+        // solid angle
+        double cos_theta = -1 + 2 * (bin / PHI_BINS + random_double()) / THETA_BINS;
+        double phi = 2 * pi * (bin % PHI_BINS + random_double()) / PHI_BINS;
+        double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        return vec3(sin_theta * std::cos(phi), cos_theta, sin_theta * std::sin(phi));
+    }
+
+    // Solid angle density sample() picks the unit direction wi with
+    static double pdf(const distribution& d, const vec3& wi) {
+        int bin = direction_bin(wi);
+        return (d.cdf[bin + 1] - d.cdf[bin]) * BINS / (4 * pi);
+    }
+
+   private:
+    concurrent_key_table cells;
+    std::unique_ptr<std::atomic<uint32_t>[]> records;  // Paths recorded into each cell
+    std::unique_ptr<std::atomic<float>[]> histograms;  // BINS summed radiance estimates per cell
+    std::vector<distribution> distributions;
+    std::vector<int> distribution_of;  // Index into distributions for each cell, -1 for none
+};
+
+#endif
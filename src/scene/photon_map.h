@@ -0,0 +1,260 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "../geometry/hittable.h"
+#include "../scene/environment.h"
+#include "../scene/light_tree.h"
+#include "../scene/material.h"
+#include "../util/spatial_hash.h"
+#include "../util/thread_pool.h"
+#include "../util/utils.h"
+
+// Light that reached a diffuse surface through one or more specular bounces
+struct photon {
+    point3 p;
+    vec3 direction;  // Unit direction the photon was travelling in
+    color power;     // Flux the photon carries
+};
+
+// Caustic photon map. Each pass shoots photons from the emitters and the environment, keeps the
+// ones that land on a diffuse surface after bouncing off metal or glass, and files them in a hashed
+// grid. Camera paths estimate caustic light at their diffuse hits from the photons around them.
+// The gather radius shrinks a little every pass as in progressive photon mapping, so the bias of
+// the density estimate fades as passes accumulate.
+class photon_map {
+   public:
+    int photons_per_pass = 200000;  // Photons shot before each pass, most miss metal and glass
+    double radius = 0.1;            // Gather radius of the first pass in world units
+    double radius_alpha = 0.7;      // Share of each pass's photons kept in the radius shrink
+    int max_bounces = 10;           // Bounces a photon may take before it is dropped
+    int table_bits = 18;            // The grid hashes into 2^table_bits cells
+
+    bool empty() const { return photons.empty(); }
+    size_t size() const { return photons.size(); }
+
+    // Shoots this pass's photons and rebuilds the map from them
+    void build(const hittable& world, const light_tree& lights, const environment& background, int pass, int frame, ThreadPool& threadPool) {
+        photons.clear();
+
+        // Progressive photon mapping shrinks the radius by (i + alpha) / (i + 1) in area each pass
+        double radius_squared = radius * radius;
+        for (int i = 1; i <= pass; i++)
+            radius_squared *= (i + radius_alpha) / (i + 1);
+        gather_radius = std::sqrt(radius_squared);
+
+        // Only metal and glass make caustics, so environment photons are aimed at them alone
+        std::vector<bounding_box> specular_bounds;
+        world.collect_specular_bounds(specular_bounds);
+        if (specular_bounds.empty())
+            return;
+
+        bounding_box target = specular_bounds.front();
+        for (const bounding_box& bounds : specular_bounds)
+            target.expand_to_contain(bounds);
+        target_center = 0.5 * (target.min + target.max);
+        target_radius = 0.5 * (target.max - target.min).length();
+
+        emitter_cdf.assign(lights.size() + 1, 0);
+        for (size_t i = 0; i < lights.size(); i++)
+            emitter_cdf[i + 1] = emitter_cdf[i] + lights.emitter(int(i)).power;
+
+        // Split the photons evenly between the two kinds of source when there are both
+        environment_photons = 0;
+        seed_random(photons_per_pass, pass, frame, RANDOM_DOMAIN);
+        if (!environment_is_black(background))
+            environment_photons = lights.empty() ? photons_per_pass : photons_per_pass / 2;
+        emitter_photons = lights.empty() ? 0 : photons_per_pass - environment_photons;
+        if (emitter_photons + environment_photons == 0)
+            return;
+
+        int job_count = (photons_per_pass + PHOTONS_PER_JOB - 1) / PHOTONS_PER_JOB;
+        std::vector<std::vector<photon>> traced(job_count);
+        run_jobs(threadPool, job_count, [&](int job) {
+            int first = job * PHOTONS_PER_JOB;
+            int last = std::min(first + PHOTONS_PER_JOB, photons_per_pass);
+            for (int i = first; i < last; i++) {
+                seed_random(i, pass, frame, RANDOM_DOMAIN);
+                shoot(world, lights, background, i < emitter_photons, traced[job]);
+            }
+        });
+
+        file_photons(traced, threadPool);
+    }
+
+    // Caustic radiance leaving the diffuse hit, estimated from the photon density around it
+    color estimate(const hit_record& rec) const {
+        if (photons.empty())
+            return color(0, 0, 0);
+
+        double radius_squared = gather_radius * gather_radius;
+        color flux(0, 0, 0);
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dz = -1; dz <= 1; dz++) {
+                    int cell = cells.find(grid_key(rec.p + gather_radius * vec3(dx, dy, dz), gather_radius));
+                    if (cell < 0)
+                        continue;
+
+                    for (uint32_t i = cell_start[cell]; i < cell_start[cell + 1]; i++) {
+                        const photon& ph = photons[i];
+                        vec3 offset = ph.p - rec.p;
+                        if (offset.length_squared() > radius_squared || dot(ph.direction, rec.normal) >= 0)
+                            continue;
+
+                        // Keep to a thin disc around the surface so light doesn't leak through corners
+                        if (std::fabs(dot(offset, rec.normal)) > 0.25 * gather_radius)
+                            continue;
+
+                        flux += ph.power;
+                    }
+                }
+            }
+        }
+
+        return (rec.mat->albedo_at(rec) / pi) * flux / (pi * radius_squared);
+    }
+
+   private:
+    static const int PHOTONS_PER_JOB = 4096;
+    static const uint64_t RANDOM_DOMAIN = 1;  // Keeps photon random numbers apart from camera samples
+
+    std::vector<photon> photons;       // Grouped by grid cell
+    concurrent_key_table cells;
+    std::vector<uint32_t> cell_start;  // First photon of each cell, cell_start[cell + 1] ends it
+    double gather_radius = 0;
+
+    point3 target_center;              // Sphere around every specular primitive
+    double target_radius = 0;
+    std::vector<double> emitter_cdf;   // Running sum of emitter power
+    int emitter_photons = 0;
+    int environment_photons = 0;
+
+    // Probes directions spread evenly over the sphere to skip shooting photons that can't carry any
+    // light
+    static bool environment_is_black(const environment& background) {
+        const int probes = 64;
+        double u1[probes], u2[probes], x[probes], y[probes], z[probes];
+        stratified_square(probes, u1, u2);
+        uniform_sphere(probes, u1, u2, x, y, z);
+        for (int i = 0; i < probes; i++)
+            if (!background.radiance(vec3(x[i], y[i], z[i])).near_zero())
+                return false;
+        return true;
+    }
+
+    // Runs job(0..count-1) on the pool and waits for all of them
+    template <typename Job>
+    static void run_jobs(ThreadPool& threadPool, int count, const Job& job) {
+        threadPool.parallel_for(0, count, 1, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                job(i);
+        });
+    }
+
+    void shoot(const hittable& world, const light_tree& lights, const environment& background, bool from_emitter, std::vector<photon>& out) const {
+        ray r;
+        color power;
+        if (from_emitter) {
+            // Emitter picked in proportion to its power, point uniform on it, direction cosine
+            // weighted around its normal
+            double target = random_double() * emitter_cdf.back();
+            int index = int(std::upper_bound(emitter_cdf.begin(), emitter_cdf.end(), target) - emitter_cdf.begin()) - 1;
+            const light_emitter& light = lights.emitter(std::clamp(index, 0, int(lights.size()) - 1));
+
+            vec3 direction = light.normal + random_unit_vector();
+            if (direction.near_zero())
+                direction = light.normal;
+
+            r = ray(light.sample_point(random_double(), random_double()), unit_vector(direction));
+            power = light.emission * (emitter_cdf.back() / (luminance(light.emission) * emitter_photons));
+        } else {
+            // Direction from the environment, starting on a disc facing it that covers the
+            // specular primitives
+            vec3 direction;
+            color radiance;
+            double pdf;
+            if (!background.sample(direction, radiance, pdf)) {
+                direction = random_unit_vector();
+                radiance = background.radiance(direction);
+                pdf = 1 / (4 * pi);
+            }
+
+            vec3 axis = std::fabs(direction.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+            vec3 u = unit_vector(cross(direction, axis));
+            vec3 v = cross(direction, u);
+            vec3 disc = random_in_unit_disk();
+            point3 origin = target_center + target_radius * (direction + disc.x() * u + disc.y() * v);
+
+            r = ray(origin, -direction);
+            power = radiance * (pi * target_radius * target_radius / (pdf * environment_photons));
+        }
+
+        bool specular_chain = false;
+        for (int bounce = 0; bounce < max_bounces; bounce++) {
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return;
+
+            if (rec.mat->is_diffuse()) {
+                // Photons that reach a diffuse surface straight away are direct light, which next
+                // event estimation already handles
+                if (specular_chain)
+                    out.push_back({rec.p, unit_vector(r.direction()), power});
+                return;
+            }
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->is_specular() || !rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+
+            specular_chain = true;
+            power = power * attenuation;
+            r = scattered;
+        }
+    }
+
+    // Files the traced photons by grid cell: counts the photons of each cell, turns the counts into
+    // start offsets, then copies every photon into its cell's range. Counting and copying run on
+    // the pool.
+    void file_photons(const std::vector<std::vector<photon>>& traced, ThreadPool& threadPool) {
+        cells.reset(table_bits);
+        auto counts = std::make_unique<std::atomic<uint32_t>[]>(cells.size());
+        for (size_t i = 0; i < cells.size(); i++)
+            counts[i] = 0;
+
+        int job_count = int(traced.size());
+        run_jobs(threadPool, job_count, [&](int job) {
+            for (const photon& ph : traced[job]) {
+                int cell = cells.claim(grid_key(ph.p, gather_radius));
+                if (cell >= 0)
+                    counts[cell]++;
+            }
+        });
+
+        cell_start.assign(cells.size() + 1, 0);
+        for (size_t i = 0; i < cells.size(); i++)
+            cell_start[i + 1] = cell_start[i] + counts[i];
+
+        // Reuse the counts as each cell's write cursor
+        for (size_t i = 0; i < cells.size(); i++)
+            counts[i] = cell_start[i];
+
+        photons.resize(cell_start.back());
+        run_jobs(threadPool, job_count, [&](int job) {
+            for (const photon& ph : traced[job]) {
+                int cell = cells.find(grid_key(ph.p, gather_radius));
+                if (cell >= 0)
+                    photons[counts[cell]++] = ph;
+            }
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include "../util/spatial_hash.h"
+#include "../util/utils.h"
+
+// A diffuse bounce waiting for its path to finish so the light that left it can be cached
+struct cache_vertex {
+    int entry;         // Cache entry of the bounce, -1 if the table had no room
+    color gathered;    // Radiance the path had gathered before the bounce's own light
+    color throughput;  // Path throughput arriving at the bounce
+};
+
+// Reflected radiance of diffuse surfaces, averaged over a hashed grid of small cells in world space
+// with one entry per cell and normal direction. Paths add what they found past each diffuse bounce
+// when they end, and later paths stop at a cached cell instead of tracing on, once its mean is
+// known well enough. Cells blur lighting over their extent, which is the bias traded for speed.
+class radiance_cache {
+   public:
+    double cell_size = 0.25;  // Edge length of a grid cell in world units
+    int query_depth = 1;      // Diffuse bounces traced in full before paths may stop at the cache
+    int min_samples = 32;     // Paths an entry needs before it is used
+    double max_error = 0.3;   // Largest relative standard error of an entry's mean it may be used with
+    int table_bits = 16;      // The grid hashes into 2^table_bits entries
+
+    void reset() {
+        entries_table.reset(table_bits);
+        entries = std::make_unique<entry[]>(entries_table.size());
+        for (size_t i = 0; i < entries_table.size(); i++) {
+            entries[i].r = entries[i].g = entries[i].b = entries[i].luminance_squared = 0;
+            entries[i].count = 0;
+        }
+    }
+
+    // Entry for the surface at p with unit normal n, claiming a new one if needed. -1 if the table
+    // is full around it.
+    int entry_for(const point3& p, const vec3& n) const {
+        return entries_table.claim(key(p, n));
+    }
+
+    // Adds one path's estimate of the radiance leaving an entry. Safe to call from any number of
+    // workers at once.
+    void record(int index, const color& radiance) const {
+        if (index < 0 || !std::isfinite(radiance.x() + radiance.y() + radiance.z()))
+            return;
+
+        entry& e = entries[index];
+        atomic_add(e.r, float(radiance.x()));
+        atomic_add(e.g, float(radiance.y()));
+        atomic_add(e.b, float(radiance.z()));
+        double l = luminance(radiance);
+        atomic_add(e.luminance_squared, float(l * l));
+        e.count++;
+    }
+
+    // Looks up the radiance leaving the surface at p with unit normal n. Returns false if the
+    // entry hasn't seen enough paths or their estimates disagree too much.
+    bool lookup(const point3& p, const vec3& n, color& radiance) const {
+        int index = entries_table.find(key(p, n));
+        if (index < 0)
+            return false;
+
+        const entry& e = entries[index];
+        double count = e.count.load(std::memory_order_relaxed);
+        if (count < min_samples)
+            return false;
+
+        radiance = color(e.r, e.g, e.b) / count;
+        double mean = luminance(radiance);
+        double variance = std::fmax(0.0, e.luminance_squared / count - mean * mean);
+        if (std::sqrt(variance / count) > max_error * mean)
+            return false;
+
+        return true;
+    }
+
+   private:
+    struct entry {
+        std::atomic<float> r, g, b;            // Sums of the recorded radiance
+        std::atomic<float> luminance_squared;  // Sum of the squared luminance of each record
+        std::atomic<uint32_t> count;           // Number of records
+    };
+
+    concurrent_key_table entries_table;
+    std::unique_ptr<entry[]> entries;
+
+    // Cell of p, tagged with the axis n points along most
+    uint64_t key(const point3& p, const vec3& n) const {
+        double ax = std::fabs(n.x()), ay = std::fabs(n.y()), az = std::fabs(n.z());
+        uint32_t axis = ax >= ay && ax >= az ? 0 : (ay >= az ? 1 : 2);
+        uint32_t negative = n[axis] < 0;
+        return grid_key(p, cell_size, axis * 2 + negative);
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef RAY_BATCH_H
+#define RAY_BATCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "../scene/path_guide.h"
+#include "../scene/radiance_cache.h"
+#include "../util/utils.h"
+
+// A path that is still bouncing around the scene
+struct path_state {
+    ray r;                   // Next segment of the path
+    color throughput;        // Product of the attenuations along the path so far
+    int pixel = 0;           // Index of the pixel the path contributes to, relative to its tile
+    double scatter_pdf = 0;  // Density the last bounce picked its direction with, 0 if it can't be light sampled
+    point3 scatter_point;    // Where the last bounce happened
+    vec3 scatter_normal;     // Surface normal at the last bounce
+    bool emitters_resampled = false;  // Emitters were already lit by ReSTIR at the last bounce
+    random_stream rng;                // The sample's random numbers, saved while the path waits in a batch
+
+    color gathered = color(0, 0, 0);      // Radiance the path has added to its pixel so far
+    int diffuse_bounces = 0;              // Diffuse bounces the path has scattered from
+    bool caustics_gathered = false;       // The photon map lit the last diffuse bounce with caustics
+    bool specular_since_diffuse = false;  // The path has bounced off metal or glass since then
+
+    static const int MAX_GUIDE_VERTICES = 8;
+    static const int MAX_CACHE_VERTICES = 4;
+
+    int guide_vertex_count = 0;  // Bounces the path guide will learn from when the path ends
+    guide_vertex guide_vertices[MAX_GUIDE_VERTICES];
+    int cache_vertex_count = 0;  // Bounces the radiance cache will learn from when the path ends
+    cache_vertex cache_vertices[MAX_CACHE_VERTICES];
+
+    path_state() {}
+
+    // A path about to trace r, everything else starting out at its default
+    path_state(const ray& r, const color& throughput, int pixel) : r(r), throughput(throughput), pixel(pixel) {}
+};
+
+// Spreads the low 10 bits of v out so there are two zero bits between each of them
+inline uint64_t expand_bits_10(uint32_t v) {
+    uint64_t x = v & 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+// Interleaves three values in [0,1] into a 30 bit Morton code
+inline uint64_t morton_3d(double x, double y, double z) {
+    auto quantize = [](double value) {
+        return uint32_t(std::clamp(value, 0.0, 1.0) * 1023.0);
+    };
+
+    return (expand_bits_10(quantize(x)) << 2) | (expand_bits_10(quantize(y)) << 1) | expand_bits_10(quantize(z));
+}
+
+// Sort key that groups rays by direction octant first, then by where they start, then by where
+// they point. Bits: [octant:3][origin morton:30][direction morton:30]
+inline uint64_t ray_sort_key(const ray& r, const bounding_box& origin_bounds) {
+    vec3 d = unit_vector(r.direction());
+    uint64_t octant = (d.x() < 0 ? 4 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 1 : 0);
+
+    vec3 extent = origin_bounds.max - origin_bounds.min;
+    vec3 o = r.origin() - origin_bounds.min;
+    uint64_t origin_code = morton_3d(
+        extent.x() > 0 ? o.x() / extent.x() : 0,
+        extent.y() > 0 ? o.y() / extent.y() : 0,
+        extent.z() > 0 ? o.z() / extent.z() : 0);
+
+    uint64_t direction_code = morton_3d(0.5 * (d.x() + 1), 0.5 * (d.y() + 1), 0.5 * (d.z() + 1));
+
+    return (octant << 60) | (origin_code << 30) | direction_code;
+}
+
+// Holds the in-flight paths of a tile so they can be reordered between bounces
+class ray_batch {
+   public:
+    std::vector<path_state> paths;
+
+    void clear() { paths.clear(); }
+
+    // Makes room for count paths up front, so adding and sorting them doesn't allocate
+    void reserve(size_t count) {
+        paths.reserve(count);
+        keys.reserve(count);
+        scratch.reserve(count);
+    }
+    bool empty() const { return paths.empty(); }
+    size_t size() const { return paths.size(); }
+
+    void add(const ray& r, int pixel) {
+        paths.push_back({r, color(1, 1, 1), pixel});
+    }
+
+    // Drops every path past the first count
+    void truncate(size_t count) {
+        paths.resize(count);
+    }
+
+    // Reorders the paths so rays that start close together and point the same way are traced
+    // one after the other and walk the same BVH nodes while they are still in cache
+    void sort() {
+        if (paths.size() < 2)
+            return;
+
+        bounding_box origin_bounds(paths[0].r.origin());
+        for (const auto& path : paths)
+            origin_bounds.expand_to_contain(path.r.origin());
+
+        keys.clear();
+        for (uint32_t i = 0; i < paths.size(); i++)
+            keys.emplace_back(ray_sort_key(paths[i].r, origin_bounds), i);
+
+        std::sort(keys.begin(), keys.end());
+
+        // Gather into the scratch buffer rather than swapping the large path structs in place
+        scratch.clear();
+        for (const auto& key : keys)
+            scratch.push_back(paths[key.second]);
+
+        paths.swap(scratch);
+    }
+
+   private:
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    std::vector<path_state> scratch;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "../util/utils.h"
+
+// A point on an emitter in the light tree
+struct light_sample {
+    int light = -1;  // Emitter index, -1 for none
+    point3 point;
+};
+
+// Weighted reservoir holding one light sample chosen out of a stream of candidates with
+// probability proportional to their weights (Bitterli et al. 2020)
+struct reservoir {
+    light_sample sample;
+    double weight_sum = 0;  // Sum of the weights of every candidate seen
+    double count = 0;       // Number of candidates the reservoir stands for (M)
+    double W = 0;           // Unbiased contribution weight of the kept sample
+
+    point3 surface_point;  // Shading point the reservoir was built for
+    vec3 surface_normal;
+
+    // Streams in one new candidate. Returns true if it replaced the kept sample.
+    bool update(const light_sample& candidate, double weight, double u) {
+        weight_sum += weight;
+        count += 1;
+        if (weight > 0 && u * weight_sum < weight) {
+            sample = candidate;
+            return true;
+        }
+        return false;
+    }
+
+    // Streams in another reservoir, whose sample has the given target value at this shading point
+    void merge(const reservoir& other, double target, double u) {
+        double weight = target * other.W * other.count;
+        weight_sum += weight;
+        count += other.count;
+        if (weight > 0 && u * weight_sum < weight)
+            sample = other.sample;
+    }
+
+    // Sets W once all candidates are in, given the target value of the kept sample
+    void finalize(double target) {
+        W = target > 0 && count > 0 ? weight_sum / (count * target) : 0;
+    }
+};
+
+// Settings for the reservoir-resampled direct lighting integrator
+struct restir_settings {
+    int candidates = 16;            // Light tree samples streamed into each new reservoir
+    bool temporal_reuse = true;     // Merge in the pixel's reservoir from its previous sample
+    int history_limit = 20;         // Cap on how many times more candidates history may stand for than a new reservoir
+    int spatial_neighbors = 3;      // Neighbouring reservoirs merged into each pixel, 0 to disable
+    int spatial_radius = 10;        // Farthest neighbour in pixels
+    double normal_threshold = 0.9;  // Neighbours must have normals at least this close
+    double depth_threshold = 0.1;   // and depths within this fraction of the pixel's
+};
+
+#endif
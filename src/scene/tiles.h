@@ -0,0 +1,222 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "../util/utils.h"
+
+// Order the tiles of an image are queued in
+enum class tile_order {
+    hilbert,    // Along a Hilbert curve, so consecutive tiles are almost always neighbours
+    spiral,     // Outward from the center of the image, where the subject usually is
+    row_major,  // Left to right, top to bottom
+};
+
+// A rectangle of the image rendered by one job. Tiles are square except along the right and
+// bottom edges.
+struct image_tile {
+    int x, y;           // Upper left pixel
+    int width, height;  // Size in pixels
+
+    // Image indices of the tile's pixels in Morton order, so pixels that are close in the list are
+    // close on screen at every scale
+    void pixels(int image_width, std::vector<int>& out) const {
+        out.clear();
+        int side = 1;
+        while (side < std::max(width, height))
+            side *= 2;
+
+        for (uint32_t code = 0; code < uint32_t(side * side); code++) {
+            int i = int(compact_bits(code));
+            int j = int(compact_bits(code >> 1));
+            if (i < width && j < height)
+                out.push_back((y + j) * image_width + x + i);
+        }
+    }
+
+    // The four quarters of the tile in Morton order, the left and upper halves taking the odd pixel
+    std::array<image_tile, 4> quadrants() const {
+        int left = (width + 1) / 2;
+        int top = (height + 1) / 2;
+        return {{
+            {x, y, left, top},
+            {x + left, y, width - left, top},
+            {x, y + top, left, height - top},
+            {x + left, y + top, width - left, height - top},
+        }};
+    }
+
+    // Spreads the even bits of code into the low half
+    static uint32_t compact_bits(uint32_t code) {
+        code &= 0x55555555;
+        code = (code | (code >> 1)) & 0x33333333;
+        code = (code | (code >> 2)) & 0x0f0f0f0f;
+        code = (code | (code >> 4)) & 0x00ff00ff;
+        code = (code | (code >> 8)) & 0x0000ffff;
+        return code;
+    }
+};
+
+// Where each pixel of an image split into tiles lives in a tile-major buffer. Every tile's pixels
+// are one block, row by row, blocks come in render order and each starts on a cache line, so two
+// tiles never write the same line and a tile's writes stay within its block. Pixels go back to
+// scanline order only when the image is output.
+class tile_major_layout {
+   public:
+    tile_major_layout() {}
+
+    // tiles as made by make_tiles(width, height, tile_size, ...), line_pixels the pixels that fit
+    // in a cache line
+    tile_major_layout(int width, int height, int tile_size, const std::vector<image_tile>& tiles, int line_pixels)
+        : tile_size(std::max(tile_size, 1)), line_pixels(std::max(line_pixels, 1)), image_width(width) {
+        columns = (width + this->tile_size - 1) / this->tile_size;
+        int rows = (height + this->tile_size - 1) / this->tile_size;
+        offsets.assign(columns * rows, 0);
+
+        for (const image_tile& tile : tiles) {
+            offsets[(tile.y / this->tile_size) * columns + tile.x / this->tile_size] = slots;
+            block_starts.push_back(slots);
+            block_ends.push_back(slots + tile.width * tile.height);
+            slots += (tile.width * tile.height + this->line_pixels - 1) / this->line_pixels * this->line_pixels;
+        }
+    }
+
+    // Slots in the buffer, counting the padding that aligns each block
+    int size() const { return slots; }
+
+    int index(int x, int y) const {
+        int column = x / tile_size;
+        int row = y / tile_size;
+        int block_width = std::min(tile_size, image_width - column * tile_size);
+        return offsets[row * columns + column] + (y - row * tile_size) * block_width + x - column * tile_size;
+    }
+
+    // Adds the cache lines a write of every pixel of rect touches to lines, and those of them that
+    // also hold pixels outside rect, which another thread might be writing, to shared. rect lies
+    // within one tile, like the quarters of a split tile.
+    void count_lines(const image_tile& rect, uint64_t& lines, uint64_t& shared) const {
+        count_rows(rect, [&](int j) { return index(rect.x, j); }, [&](int slot) { return slot < slots && !padding(slot); }, lines, shared);
+    }
+
+    // The same count for a scanline buffer of the image, for comparison
+    void count_scanline_lines(const image_tile& rect, int height, uint64_t& lines, uint64_t& shared) const {
+        count_rows(rect, [&](int j) { return j * image_width + rect.x; }, [&](int slot) { return slot < image_width * height; }, lines, shared);
+    }
+
+   private:
+    int tile_size = 1;
+    int line_pixels = 1;
+    int image_width = 0;
+    int columns = 0;
+    int slots = 0;
+    std::vector<int> offsets;       // First slot of each tile, by row then column of the tile grid
+    std::vector<int> block_starts;  // First slot of each block, in buffer order
+    std::vector<int> block_ends;    // Slot after the last pixel of each block
+
+    bool padding(int slot) const {
+        size_t block = std::upper_bound(block_starts.begin(), block_starts.end(), slot) - block_starts.begin() - 1;
+        return slot >= block_ends[block];
+    }
+
+    // Rows of rect start at row_start(j) and follow each other in the buffer, so rows that are
+    // contiguous there are merged into one run before counting
+    template <typename RowStart, typename Used>
+    void count_rows(const image_tile& rect, const RowStart& row_start, const Used& used, uint64_t& lines, uint64_t& shared) const {
+        int run_start = -1, run_end = -1;
+        auto flush = [&]() {
+            if (run_start < 0)
+                return;
+            int first = run_start / line_pixels;
+            int last = (run_end - 1) / line_pixels;
+            bool shared_first = false, shared_last = false;
+            for (int slot = first * line_pixels; slot < run_start; slot++)
+                shared_first = shared_first || used(slot);
+            for (int slot = run_end; slot < (last + 1) * line_pixels; slot++)
+                shared_last = shared_last || used(slot);
+
+            lines += last - first + 1;
+            shared += first == last ? (shared_first || shared_last) : int(shared_first) + int(shared_last);
+        };
+
+        for (int j = rect.y; j < rect.y + rect.height; j++) {
+            int start = row_start(j);
+            if (start != run_end) {
+                flush();
+                run_start = start;
+            }
+            run_end = start + rect.width;
+        }
+        flush();
+    }
+};
+
+// Distance of cell x, y along the Hilbert curve filling a side by side grid, side a power of two
+inline uint64_t hilbert_index(uint32_t side, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve inside it starts and ends where its neighbours expect
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Splits a width by height image into tile_size squares, listed in the given order
+inline std::vector<image_tile> make_tiles(int width, int height, int tile_size, tile_order order) {
+    tile_size = std::max(tile_size, 1);
+    int columns = (width + tile_size - 1) / tile_size;
+    int rows = (height + tile_size - 1) / tile_size;
+
+    std::vector<image_tile> tiles;
+    std::vector<uint64_t> keys;
+    uint32_t side = 1;
+    while (side < uint32_t(std::max(columns, rows)))
+        side *= 2;
+
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            int x = column * tile_size;
+            int y = row * tile_size;
+            tiles.push_back({x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)});
+
+            if (order == tile_order::hilbert) {
+                keys.push_back(hilbert_index(side, column, row));
+            } else if (order == tile_order::spiral) {
+                // Ring around the center first, then angle within the ring
+                double dx = column + 0.5 - columns / 2.0;
+                double dy = row + 0.5 - rows / 2.0;
+                uint64_t ring = uint64_t(std::max(std::fabs(dx), std::fabs(dy)));
+                uint64_t angle = uint64_t((std::atan2(dy, dx) + pi) / (2 * pi) * 65535);
+                keys.push_back(ring << 16 | angle);
+            } else {
+                keys.push_back(tiles.size());
+            }
+        }
+    }
+
+    std::vector<int> order_of(tiles.size());
+    for (size_t i = 0; i < order_of.size(); i++)
+        order_of[i] = int(i);
+    std::stable_sort(order_of.begin(), order_of.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+    std::vector<image_tile> ordered;
+    ordered.reserve(tiles.size());
+    for (int i : order_of)
+        ordered.push_back(tiles[i]);
+    return ordered;
+}
+
+#endif
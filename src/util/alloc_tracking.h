@@ -0,0 +1,213 @@
+#ifndef ALLOC_TRACKING_H
+#define ALLOC_TRACKING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <utility>
+
+// Off unless built with -DALLOC_TRACKING, since it replaces the global operator new and delete.
+// Tracking builds stop at the first heap allocation made inside a no_alloc_scope, or with NDEBUG
+// as well only count it.
+#ifdef ALLOC_TRACKING
+#define ALLOC_TRACKING_ENABLED true
+#else
+#define ALLOC_TRACKING_ENABLED false
+#endif
+
+#if defined(ALLOC_TRACKING) && !defined(NDEBUG)
+#define ALLOC_TRACKING_FATAL true
+#else
+#define ALLOC_TRACKING_FATAL false
+#endif
+
+// Parts of a run that heap allocations are counted under
+enum class alloc_phase {
+    setup,   // Before any other phase, and anything not marked as one
+    load,    // Reading files and decoding textures
+    build,   // Building BVHs and the other acceleration structures
+    render,  // From the start of a render until its image is ready
+    write,   // Writing the image out
+    phase_count,
+};
+
+// What the heap allocations of a thread count as: the phase it works in, or -1 to follow the
+// process's, and how deep it is in no_alloc_scopes
+struct alloc_context {
+    int phase = -1;
+    int forbidden_depth = 0;
+};
+
+// Heap allocations of the whole process, counted by the replaced global operator new below, per
+// phase. The phase is set for the whole process, and threads may override it for the work they do
+// with a phase_scope, like loading and building running side by side. ThreadPool jobs run in the
+// context of the thread that queued them, so work handed to the pool from inside a no_alloc_scope
+// may not allocate either.
+class alloc_tracking {
+   public:
+    static void set_phase(alloc_phase phase) { global_phase = int(phase); }
+    static alloc_phase phase() { return alloc_phase(global_phase.load()); }
+
+    // Work done by this thread while alive counts under phase
+    class phase_scope {
+       public:
+        explicit phase_scope(alloc_phase phase) : previous(local_phase()) { local_phase() = int(phase); }
+        ~phase_scope() { local_phase() = previous; }
+
+        phase_scope(const phase_scope&) = delete;
+        phase_scope& operator=(const phase_scope&) = delete;
+
+       private:
+        int previous;
+    };
+
+    // Context of this thread, for handing on to a context_scope on the thread that does its work
+    static alloc_context thread_context() { return {local_phase(), forbidden_depth()}; }
+
+    // Runs this thread in another thread's context while alive
+    class context_scope {
+       public:
+        explicit context_scope(const alloc_context& context) : previous(thread_context()) { set_thread_context(context); }
+        ~context_scope() { set_thread_context(previous); }
+
+        context_scope(const context_scope&) = delete;
+        context_scope& operator=(const context_scope&) = delete;
+
+       private:
+        alloc_context previous;
+    };
+
+    static void record(size_t bytes) {
+        int phase = local_phase() >= 0 ? local_phase() : global_phase.load(std::memory_order_relaxed);
+        counts[phase].fetch_add(1, std::memory_order_relaxed);
+        sizes[phase].fetch_add(bytes, std::memory_order_relaxed);
+
+        if (forbidden_depth() > 0) {
+            forbidden.fetch_add(1, std::memory_order_relaxed);
+            if (ALLOC_TRACKING_FATAL) {
+                // Nothing here may allocate
+                std::fputs("Heap allocation in the render hot path, which must not allocate\n", stderr);
+                std::abort();
+            }
+        }
+    }
+
+    static uint64_t count(alloc_phase phase) { return counts[int(phase)]; }
+    static uint64_t bytes(alloc_phase phase) { return sizes[int(phase)]; }
+
+    // Allocations made inside a no_alloc_scope, which a tracking debug build would have stopped at
+    static uint64_t forbidden_count() { return forbidden; }
+
+    static void print(std::ostream& out) {
+        static const char* names[] = {"setup", "load", "build", "render", "write"};
+        out << "Allocations:";
+        for (int phase = 0; phase < int(alloc_phase::phase_count); phase++)
+            out << (phase == 0 ? " " : ", ") << names[phase] << " " << counts[phase] << " (" << sizes[phase] / 1e6 << "MB)";
+        out << "\n-Allocations in the render hot path: " << forbidden << "\n";
+    }
+
+    // Nesting depth of no_alloc_scopes on this thread
+    static int& forbidden_depth() {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+   private:
+    static inline std::atomic<int> global_phase{int(alloc_phase::setup)};
+    static inline std::atomic<uint64_t> counts[int(alloc_phase::phase_count)] = {};
+    static inline std::atomic<uint64_t> sizes[int(alloc_phase::phase_count)] = {};
+    static inline std::atomic<uint64_t> forbidden{0};
+
+    static int& local_phase() {
+        thread_local int phase = -1;  // -1 follows global_phase
+        return phase;
+    }
+
+    static void set_thread_context(const alloc_context& context) {
+        local_phase() = context.phase;
+        forbidden_depth() = context.forbidden_depth;
+    }
+};
+
+// Marks code of the calling thread that must not touch the heap, like tracing and shading a ray.
+// Buffers it needs are made beforehand and reused.
+class no_alloc_scope {
+   public:
+    no_alloc_scope() {
+        if (ALLOC_TRACKING_ENABLED)
+            alloc_tracking::forbidden_depth()++;
+    }
+
+    ~no_alloc_scope() {
+        if (ALLOC_TRACKING_ENABLED)
+            alloc_tracking::forbidden_depth()--;
+    }
+
+    no_alloc_scope(const no_alloc_scope&) = delete;
+    no_alloc_scope& operator=(const no_alloc_scope&) = delete;
+};
+
+// Lets code inside a no_alloc_scope allocate again, for buffers that are kept and reused, so they
+// only grow until they fit the largest job they are used for
+class growth_scope {
+   public:
+    growth_scope() {
+        if (ALLOC_TRACKING_ENABLED)
+            std::swap(depth, alloc_tracking::forbidden_depth());
+    }
+
+    ~growth_scope() {
+        if (ALLOC_TRACKING_ENABLED)
+            std::swap(depth, alloc_tracking::forbidden_depth());
+    }
+
+    growth_scope(const growth_scope&) = delete;
+    growth_scope& operator=(const growth_scope&) = delete;
+
+   private:
+    int depth = 0;  // Of the scopes it lifted while alive
+};
+
+#if ALLOC_TRACKING_ENABLED
+// Replacements of the global allocation functions, defined here like the other globals of these
+// headers, so they belong to the one source file that includes them. The array and nothrow forms
+// call these. Kept out of line, so the compiler doesn't pair the malloc and free inside them with
+// the new and delete at call sites and warn that they don't match.
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    alloc_tracking::record(size);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// Over-allocates with malloc, which is all every platform has, and keeps the pointer malloc
+// returned just before the aligned block
+[[gnu::noinline]] void* operator new(std::size_t size, std::align_val_t alignment) {
+    alloc_tracking::record(size);
+    size_t align = std::max(size_t(alignment), sizeof(void*));
+    void* raw = std::malloc(size + align + sizeof(void*));
+    if (!raw)
+        throw std::bad_alloc();
+
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + align - 1) & ~uintptr_t(align - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+[[gnu::noinline]] void operator delete(void* p, std::align_val_t) noexcept {
+    if (p)
+        std::free(static_cast<void**>(p)[-1]);
+}
+
+[[gnu::noinline]] void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept { operator delete(p, alignment); }
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// How pool threads are pinned to CPUs
+enum class affinity_policy {
+    none,     // Left to the OS scheduler
+    compact,  // Packed onto as few NUMA nodes as possible, sharing their caches
+    scatter,  // Spread round robin over the NUMA nodes, using all of their memory bandwidth
+};
+
+// One logical CPU the process may run on
+struct cpu_info {
+    int cpu;              // OS number of the CPU
+    int core;             // Physical core, shared by SMT siblings
+    int numa_node;        // Memory node the CPU is closest to
+    bool primary_thread;  // Lowest numbered SMT sibling of its core
+};
+
+// The CPUs of the machine and the NUMA nodes they belong to, read from sysfs on Linux. Elsewhere,
+// or if sysfs can't be read, every hardware thread counts as its own core on a single node.
+class cpu_topology {
+   public:
+    std::vector<cpu_info> cpus;
+    int numa_node_count = 1;
+
+    static const cpu_topology& get() {
+        static const cpu_topology topology;
+        return topology;
+    }
+
+    int primary_thread_count() const {
+        return int(std::count_if(cpus.begin(), cpus.end(), [](const cpu_info& c) { return c.primary_thread; }));
+    }
+
+    // CPU for each of count threads under the policy, or an empty list for affinity_policy::none.
+    // With skip_smt_siblings, second threads of a core are only used once every core has one.
+    std::vector<cpu_info> placement(affinity_policy policy, int count, bool skip_smt_siblings) const {
+        std::vector<cpu_info> result;
+        if (policy == affinity_policy::none || cpus.empty() || count <= 0)
+            return result;
+
+        // Rank of each CPU within its node, so scatter can deal them out node by node
+        std::vector<cpu_info> ordered = cpus;
+        std::vector<int> rank(ordered.size());
+        std::stable_sort(ordered.begin(), ordered.end(), [&](const cpu_info& a, const cpu_info& b) {
+            if (skip_smt_siblings && a.primary_thread != b.primary_thread)
+                return a.primary_thread;
+            if (a.numa_node != b.numa_node)
+                return a.numa_node < b.numa_node;
+            return a.core < b.core;
+        });
+
+        if (policy == affinity_policy::scatter) {
+            std::vector<int> seen(numa_node_count, 0);
+            for (size_t i = 0; i < ordered.size(); i++)
+                rank[i] = seen[ordered[i].numa_node]++;
+
+            std::vector<size_t> index(ordered.size());
+            for (size_t i = 0; i < index.size(); i++)
+                index[i] = i;
+            std::stable_sort(index.begin(), index.end(), [&](size_t a, size_t b) {
+                if (skip_smt_siblings && ordered[a].primary_thread != ordered[b].primary_thread)
+                    return bool(ordered[a].primary_thread);
+                if (rank[a] != rank[b])
+                    return rank[a] < rank[b];
+                return ordered[a].numa_node < ordered[b].numa_node;
+            });
+
+            std::vector<cpu_info> scattered;
+            for (size_t i : index)
+                scattered.push_back(ordered[i]);
+            ordered.swap(scattered);
+        }
+
+        // More threads than CPUs wrap around
+        for (int i = 0; i < count; i++)
+            result.push_back(ordered[i % ordered.size()]);
+        return result;
+    }
+
+   private:
+    cpu_topology() {
+#if defined(__linux__)
+        std::vector<int> online = read_list("/sys/devices/system/cpu/online");
+        for (int cpu : online) {
+            std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+            std::vector<int> siblings = read_list(base + "thread_siblings_list");
+            int package = read_int(base + "physical_package_id", 0);
+            int core = read_int(base + "core_id", cpu);
+            cpus.push_back({cpu, package * 65536 + core, 0, siblings.empty() || siblings.front() == cpu});
+        }
+
+        std::vector<int> nodes = read_list("/sys/devices/system/node/online");
+        for (int node : nodes) {
+            for (int cpu : read_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+                for (cpu_info& c : cpus)
+                    if (c.cpu == cpu)
+                        c.numa_node = node;
+            numa_node_count = std::max(numa_node_count, node + 1);
+        }
+#endif
+
+        if (cpus.empty()) {
+            int count = std::max(1u, std::thread::hardware_concurrency());
+            for (int i = 0; i < count; i++)
+                cpus.push_back({i, i, 0, true});
+        }
+    }
+
+    // Parses a sysfs CPU list like "0-3,8,10-11"
+    static std::vector<int> read_list(const std::string& path) {
+        std::vector<int> result;
+        std::ifstream file(path);
+        std::string text;
+        if (!std::getline(file, text))
+            return result;
+
+        std::stringstream ranges(text);
+        std::string range;
+        while (std::getline(ranges, range, ',')) {
+            size_t dash = range.find('-');
+            try {
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int i = first; i <= last; i++)
+                    result.push_back(i);
+            } catch (const std::exception&) {
+                return {};
+            }
+        }
+        return result;
+    }
+
+    static int read_int(const std::string& path, int fallback) {
+        std::ifstream file(path);
+        int value;
+        return file >> value ? value : fallback;
+    }
+};
+
+// NUMA node of the CPU the calling thread is pinned to, -1 if it isn't pinned
+inline int& current_numa_node() {
+    thread_local int node = -1;
+    return node;
+}
+
+// Pins the calling thread to one CPU and records its node. Does nothing where pinning isn't
+// supported.
+inline void pin_current_thread(const cpu_info& cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu.cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+        current_numa_node() = cpu.numa_node;
+#endif
+}
+
+// Runs fn on a short lived thread pinned to a CPU of the node, so memory it touches first is
+// placed on that node by the kernel's default first-touch policy
+template <typename Fn>
+void run_on_numa_node(int node, const Fn& fn) {
+    const cpu_topology& topology = cpu_topology::get();
+    auto it = std::find_if(topology.cpus.begin(), topology.cpus.end(), [node](const cpu_info& c) { return c.numa_node == node; });
+    if (it == topology.cpus.end()) {
+        fn();
+        return;
+    }
+
+    cpu_info cpu = *it;
+    std::thread worker([&fn, cpu]() {
+        pin_current_thread(cpu);
+        fn();
+    });
+    worker.join();
+}
+
+// Allocator whose default construction leaves memory untouched, so a buffer can be sized on one
+// thread and first written, and so placed in memory, by the threads that will use it. Buffers
+// start on a cache line, so ranges of them aligned to lines are never shared between threads.
+template <typename T>
+struct first_touch_allocator : std::allocator<T> {
+    static constexpr size_t alignment = alignof(T) > 64 ? alignof(T) : 64;
+
+    template <typename U>
+    struct rebind {
+        using other = first_touch_allocator<U>;
+    };
+
+    first_touch_allocator() = default;
+    template <typename U>
+    first_touch_allocator(const first_touch_allocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(alignment)); }
+
+    template <typename U>
+    void construct(U*) {}
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+#endif
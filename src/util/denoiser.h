@@ -0,0 +1,148 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <algorithm>
+#include <vector>
+
+#include "thread_pool.h"
+#include "utils.h"
+
+// What a camera ray saw at its first hit
+struct surface_features {
+    color albedo;      // Surface color, white for rays that left the scene
+    vec3 normal;       // Surface normal, zero for rays that left the scene
+    double depth = 0;  // Distance along the ray
+};
+
+// Per-pixel sums of the first-hit features of every sample, filled in while rendering
+class feature_buffers {
+   public:
+    static constexpr double MISS_DEPTH = 1e9;  // Depth recorded for rays that left the scene
+
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+    std::vector<double> depth;
+
+    void resize(size_t pixel_count) {
+        albedo.assign(pixel_count, color(0, 0, 0));
+        normal.assign(pixel_count, vec3(0, 0, 0));
+        depth.assign(pixel_count, 0);
+    }
+
+    bool empty() const { return albedo.empty(); }
+
+    void add(size_t pixel, const surface_features& features) {
+        albedo[pixel] += features.albedo;
+        normal[pixel] += features.normal;
+        depth[pixel] += features.depth;
+    }
+
+    // Averages the sums over the given number of samples
+    feature_buffers resolve(int samples) const {
+        double scale = 1.0 / std::max(samples, 1);
+
+        feature_buffers resolved = *this;
+        for (size_t i = 0; i < albedo.size(); i++) {
+            resolved.albedo[i] *= scale;
+            resolved.depth[i] *= scale;
+            if (!normal[i].near_zero())
+                resolved.normal[i] = unit_vector(normal[i]);
+        }
+
+        return resolved;
+    }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each iteration blurs with a 5x5
+// B3 spline kernel whose taps are spread twice as far apart as the last, and weights each tap down
+// where its color, albedo, normal or depth differs from the center pixel. Albedo is divided out
+// before filtering and multiplied back in after, so texture detail is kept.
+class denoiser {
+   public:
+    int iterations = 5;          // Number of filter passes, the kernel covers 4 * 2^iterations pixels
+    double color_sigma = 0.5;    // Color difference tolerated by the first pass, halved each pass
+    double albedo_sigma = 0.1;   // Albedo difference tolerated between neighbours
+    double normal_power = 64;    // Exponent on the cosine between neighbouring normals
+    double depth_sigma = 0.05;   // Depth difference tolerated, relative to the center depth
+
+    void denoise(
+        std::vector<color>& image, const feature_buffers& features, int width, int height, ThreadPool& threadPool) const {
+        // Filter irradiance rather than radiance so textures stay sharp
+        std::vector<color> current(image.size());
+        for (size_t i = 0; i < image.size(); i++)
+            current[i] = demodulate(image[i], features.albedo[i]);
+
+        std::vector<color> next(image.size());
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            int step = 1 << iteration;
+            double sigma = color_sigma / step;
+
+            threadPool.parallel_for(0, height, ROWS_PER_JOB, [&](int first_row, int last_row) {
+                for (int y = first_row; y < last_row; y++)
+                    for (int x = 0; x < width; x++)
+                        next[y * width + x] = filter_pixel(current, features, width, height, x, y, step, sigma);
+            });
+
+            current.swap(next);
+        }
+
+        for (size_t i = 0; i < image.size(); i++)
+            image[i] = current[i] * (features.albedo[i] + color(ALBEDO_EPSILON, ALBEDO_EPSILON, ALBEDO_EPSILON));
+    }
+
+   private:
+    static const int ROWS_PER_JOB = 8;
+    static constexpr double ALBEDO_EPSILON = 0.01;  // Keeps nearly black surfaces from blowing up
+
+    static color demodulate(const color& c, const color& albedo) {
+        return color(
+            c.x() / (albedo.x() + ALBEDO_EPSILON),
+            c.y() / (albedo.y() + ALBEDO_EPSILON),
+            c.z() / (albedo.z() + ALBEDO_EPSILON));
+    }
+
+    color filter_pixel(
+        const std::vector<color>& input, const feature_buffers& features,
+        int width, int height, int x, int y, int step, double sigma) const {
+        static const double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+        int center = y * width + x;
+        const color& center_color = input[center];
+        const color& center_albedo = features.albedo[center];
+        const vec3& center_normal = features.normal[center];
+        double center_depth = features.depth[center];
+        double depth_scale = depth_sigma * std::max(center_depth, 1e-3);
+
+        color sum(0, 0, 0);
+        double weight_sum = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height)
+                continue;
+
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width)
+                    continue;
+
+                int q = qy * width + qx;
+                double weight = kernel[dx + 2] * kernel[dy + 2];
+
+                weight *= std::exp(-(input[q] - center_color).length_squared() / (sigma * sigma));
+                weight *= std::exp(-(features.albedo[q] - center_albedo).length_squared() / (albedo_sigma * albedo_sigma));
+                weight *= std::exp(-std::fabs(features.depth[q] - center_depth) / depth_scale);
+
+                // Pixels that only saw the sky have no normal to compare
+                if (!center_normal.near_zero() || !features.normal[q].near_zero())
+                    weight *= std::pow(std::fmax(0.0, dot(center_normal, features.normal[q])), normal_power);
+
+                sum += weight * input[q];
+                weight_sum += weight;
+            }
+        }
+
+        return weight_sum > 0 ? sum / weight_sum : center_color;
+    }
+};
+
+#endif
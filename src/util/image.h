@@ -14,6 +14,9 @@
 
 class image {
    public:
+    // Empty until an image is moved in, samples as missing
+    image() : width(0), height(0), channels(0) {}
+
     image(const std::string& filename) {
         data = stbi_load(filename.c_str(), &width, &height, &channels, 0);
         if (!data) {
@@ -112,4 +115,46 @@ class image {
     int channels;                   // Number of color channels in the image (e.g., 3 for RGB, 4 for RGBA)
 };
 
+// Linear, floating point RGB image such as a Radiance .hdr file
+class hdr_image {
+   public:
+    hdr_image(const std::string& filename) {
+        int channels;
+        data = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+        if (!data) {
+            throw std::runtime_error("Failed to load HDR image: " + filename);
+        }
+    }
+
+    ~hdr_image() {
+        if (data) {
+            stbi_image_free(data);
+            data = nullptr;
+        }
+    }
+
+    // Delete copy constructor and assignment operator to prevent double-free
+    hdr_image(const hdr_image&) = delete;
+    hdr_image& operator=(const hdr_image&) = delete;
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    // Returns the pixel at x, y, which must be within the image bounds
+    color pixel(int x, int y) const {
+        int index = (y * width + x) * 3;
+        return color(data[index], data[index + 1], data[index + 2]);
+    }
+
+   private:
+    float* data = nullptr;  // Pointer to the RGB float data
+    int width;              // Width of the image
+    int height;             // Height of the image
+};
+
 #endif
\ No newline at end of file
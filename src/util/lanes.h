@@ -0,0 +1,303 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <cstdint>
+
+#include "../util/utils.h"
+
+// Lane-parallel math for code that works on several rays at once. Each type holds N independent
+// values in structure of arrays form, one GCC vector per component, so an operation on them is a
+// single instruction per component on whatever the target supports: AVX-512 for 8 doubles, AVX2
+// for 4, SSE2 for 2. Widths the target can't hold in one register are split by the compiler, and
+// without SIMD the vectors fall back to plain scalar code, so every width works everywhere.
+
+// Widest lane count one register of the build target holds
+#if defined(__AVX512F__)
+const int LANE_WIDTH = 8;
+#elif defined(__AVX__)
+const int LANE_WIDTH = 4;
+#elif defined(__SSE2__)
+const int LANE_WIDTH = 2;
+#else
+const int LANE_WIDTH = 1;
+#endif
+
+template <int N>
+struct lane_types {
+    typedef double real __attribute__((vector_size(N * sizeof(double))));
+    typedef int64_t mask __attribute__((vector_size(N * sizeof(int64_t))));  // All bits set in true lanes
+};
+
+// N doubles
+template <int N>
+using realx = typename lane_types<N>::real;
+
+// N booleans, the result of comparing realx values
+template <int N>
+class maskx {
+   public:
+    typename lane_types<N>::mask m;
+
+    maskx() : m{} {}
+    maskx(typename lane_types<N>::mask m) : m(m) {}
+
+    // Every lane set to value
+    static maskx all_lanes(bool value) {
+        maskx result;
+        result.m = result.m + (value ? -1 : 0);
+        return result;
+    }
+
+    // Lane i set where bit i of bits is
+    static maskx from_bits(uint32_t bits) {
+        typename lane_types<N>::mask lane_bit = {};
+        for (int i = 0; i < N; i++)
+            lane_bit[i] = int64_t(1) << i;
+        return maskx((lane_bit & int64_t(bits)) != 0);
+    }
+
+    bool operator[](int i) const { return m[i] != 0; }
+    void set(int i, bool value) { m[i] = value ? -1 : 0; }
+
+    maskx operator&(const maskx& other) const { return maskx(m & other.m); }
+    maskx operator|(const maskx& other) const { return maskx(m | other.m); }
+    maskx operator~() const { return maskx(~m); }
+
+    // One bit per lane, lane 0 lowest
+    uint32_t bits() const {
+        uint32_t result = 0;
+        for (int i = 0; i < N; i++)
+            result |= uint32_t(m[i] != 0) << i;
+        return result;
+    }
+
+    bool any() const { return bits() != 0; }
+    bool all() const { return bits() == (uint32_t(1) << N) - 1; }
+    bool none() const { return bits() == 0; }
+    int count() const { return __builtin_popcount(bits()); }
+};
+
+template <int N>
+inline realx<N> broadcast(double value) {
+    realx<N> result = {};
+    return result + value;
+}
+
+// a where mask is set, b elsewhere
+template <int N>
+inline realx<N> select(const maskx<N>& mask, const realx<N>& a, const realx<N>& b) {
+    return mask.m ? a : b;
+}
+
+// Number of lanes of a realx type. Functions that only take realx values are templated on the
+// vector type itself, since N can't be deduced through the lane_types typedef.
+template <typename V>
+constexpr int lane_count() {
+    return int(sizeof(V) / sizeof(double));
+}
+
+template <typename V>
+inline V lane_min(const V& a, const V& b) {
+    return b < a ? b : a;
+}
+
+template <typename V>
+inline V lane_max(const V& a, const V& b) {
+    return a < b ? b : a;
+}
+
+// Smallest value of the lanes where mask is set, infinity if none are
+template <typename V>
+inline double horizontal_min(const V& a, const maskx<lane_count<V>()>& mask) {
+    double result = infinity;
+    for (int i = 0; i < lane_count<V>(); i++)
+        if (mask[i] && a[i] < result)
+            result = a[i];
+    return result;
+}
+
+template <typename V>
+inline double horizontal_min(const V& a) {
+    return horizontal_min(a, maskx<lane_count<V>()>::all_lanes(true));
+}
+
+// Index of the smallest lane where mask is set, -1 if none are
+template <typename V>
+inline int horizontal_argmin(const V& a, const maskx<lane_count<V>()>& mask) {
+    int index = -1;
+    for (int i = 0; i < lane_count<V>(); i++)
+        if (mask[i] && (index < 0 || a[i] < a[index]))
+            index = i;
+    return index;
+}
+
+template <typename V>
+inline int horizontal_argmin(const V& a) {
+    return horizontal_argmin(a, maskx<lane_count<V>()>::all_lanes(true));
+}
+
+template <typename V>
+inline double horizontal_max(const V& a, const maskx<lane_count<V>()>& mask) {
+    double result = -infinity;
+    for (int i = 0; i < lane_count<V>(); i++)
+        if (mask[i] && a[i] > result)
+            result = a[i];
+    return result;
+}
+
+template <typename V>
+inline double horizontal_max(const V& a) {
+    return horizontal_max(a, maskx<lane_count<V>()>::all_lanes(true));
+}
+
+template <typename V>
+inline double reduce_add(const V& a) {
+    double result = 0;
+    for (int i = 0; i < lane_count<V>(); i++)
+        result += a[i];
+    return result;
+}
+
+// N vectors, one lane each
+template <int N>
+class vec3x {
+   public:
+    realx<N> x, y, z;
+
+    vec3x() : x{}, y{}, z{} {}
+    vec3x(const realx<N>& x, const realx<N>& y, const realx<N>& z) : x(x), y(y), z(z) {}
+
+    // v in every lane
+    explicit vec3x(const vec3& v) : x(broadcast<N>(v.x())), y(broadcast<N>(v.y())), z(broadcast<N>(v.z())) {}
+
+    vec3 get(int i) const { return vec3(x[i], y[i], z[i]); }
+
+    void set(int i, const vec3& v) {
+        x[i] = v.x();
+        y[i] = v.y();
+        z[i] = v.z();
+    }
+
+    vec3x operator-() const { return vec3x(-x, -y, -z); }
+
+    vec3x& operator+=(const vec3x& v) {
+        x += v.x;
+        y += v.y;
+        z += v.z;
+        return *this;
+    }
+
+    realx<N> length_squared() const { return x * x + y * y + z * z; }
+};
+
+template <int N>
+inline vec3x<N> operator+(const vec3x<N>& u, const vec3x<N>& v) {
+    return vec3x<N>(u.x + v.x, u.y + v.y, u.z + v.z);
+}
+
+template <int N>
+inline vec3x<N> operator-(const vec3x<N>& u, const vec3x<N>& v) {
+    return vec3x<N>(u.x - v.x, u.y - v.y, u.z - v.z);
+}
+
+template <int N>
+inline vec3x<N> operator*(const vec3x<N>& u, const vec3x<N>& v) {
+    return vec3x<N>(u.x * v.x, u.y * v.y, u.z * v.z);
+}
+
+// Each lane scaled by its own t
+template <int N>
+inline vec3x<N> operator*(const realx<N>& t, const vec3x<N>& v) {
+    return vec3x<N>(t * v.x, t * v.y, t * v.z);
+}
+
+template <int N>
+inline realx<N> dot(const vec3x<N>& u, const vec3x<N>& v) {
+    return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+template <int N>
+inline vec3x<N> cross(const vec3x<N>& u, const vec3x<N>& v) {
+    return vec3x<N>(u.y * v.z - u.z * v.y,
+                    u.z * v.x - u.x * v.z,
+                    u.x * v.y - u.y * v.x);
+}
+
+template <int N>
+inline vec3x<N> unit_vector(const vec3x<N>& v) {
+    realx<N> length = {};
+    realx<N> length_squared = v.length_squared();
+    for (int i = 0; i < N; i++)
+        length[i] = std::sqrt(length_squared[i]);
+    return (1 / length) * v;
+}
+
+template <int N>
+inline vec3x<N> select(const maskx<N>& mask, const vec3x<N>& a, const vec3x<N>& b) {
+    return vec3x<N>(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+}
+
+template <int N>
+inline vec3x<N> lane_min(const vec3x<N>& a, const vec3x<N>& b) {
+    return vec3x<N>(lane_min(a.x, b.x), lane_min(a.y, b.y), lane_min(a.z, b.z));
+}
+
+template <int N>
+inline vec3x<N> lane_max(const vec3x<N>& a, const vec3x<N>& b) {
+    return vec3x<N>(lane_max(a.x, b.x), lane_max(a.y, b.y), lane_max(a.z, b.z));
+}
+
+// N rays, with the reciprocal directions the slab test needs
+template <int N>
+class rayx {
+   public:
+    vec3x<N> origin;
+    vec3x<N> direction;
+    vec3x<N> dir_inv;
+
+    rayx() {}
+
+    // Packs rays[0..N-1]
+    explicit rayx(const ray* rays) {
+        for (int i = 0; i < N; i++)
+            set(i, rays[i]);
+    }
+
+    void set(int i, const ray& r) {
+        origin.set(i, r.origin());
+        direction.set(i, r.direction());
+        dir_inv.set(i, r.dir_inv);
+    }
+
+    ray get(int i) const { return ray(origin.get(i), direction.get(i)); }
+
+    vec3x<N> at(const realx<N>& t) const { return origin + t * direction; }
+};
+
+// N intervals
+template <int N>
+class intervalx {
+   public:
+    realx<N> min, max;
+
+    intervalx() : min(broadcast<N>(+infinity)), max(broadcast<N>(-infinity)) {}  // Empty in every lane
+    intervalx(const realx<N>& min, const realx<N>& max) : min(min), max(max) {}
+    explicit intervalx(const interval& i) : min(broadcast<N>(i.min)), max(broadcast<N>(i.max)) {}
+
+    interval get(int i) const { return interval(min[i], max[i]); }
+
+    maskx<N> contains(const realx<N>& t) const { return maskx<N>(min <= t) & maskx<N>(t <= max); }
+    maskx<N> surrounds(const realx<N>& t) const { return maskx<N>(min < t) & maskx<N>(t < max); }
+    realx<N> clamp(const realx<N>& t) const { return lane_min(lane_max(t, min), max); }
+};
+
+// The widths of the common targets, and the one this build fills a register with
+using vec3x4 = vec3x<4>;
+using vec3x8 = vec3x<8>;
+using realxN = realx<LANE_WIDTH>;
+using vec3xN = vec3x<LANE_WIDTH>;
+using rayxN = rayx<LANE_WIDTH>;
+using intervalxN = intervalx<LANE_WIDTH>;
+using maskxN = maskx<LANE_WIDTH>;
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Off unless built with -DPERF_COUNTERS, since it opens the counters for every render and prints
+// what they counted
+#ifdef PERF_COUNTERS
+#define PERF_COUNTERS_ENABLED true
+#else
+#define PERF_COUNTERS_ENABLED false
+#endif
+
+// Hardware counters of the CPU read through Linux's perf_event_open, to see how render settings
+// like the tile order change cache behaviour. The counters follow threads created after start(),
+// so start them before the thread pool. Where the kernel doesn't allow it (other platforms,
+// containers, a strict perf_event_paranoid) every counter reads as unavailable and nothing else
+// changes.
+class perf_counters {
+   public:
+    enum counter {
+        cycles,
+        instructions,
+        cache_references,  // Last level cache accesses
+        cache_misses,      // Last level cache misses
+        counter_count,
+    };
+
+    perf_counters() {
+        for (int& fd : fds)
+            fd = -1;
+    }
+
+    ~perf_counters() { close_all(); }
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    void start() {
+        close_all();
+#if defined(__linux__)
+        static const uint64_t configs[counter_count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_REFERENCES,
+            PERF_COUNT_HW_CACHE_MISSES,
+        };
+
+        for (int i = 0; i < counter_count; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.inherit = 1;  // Count the worker threads too
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Freezes the counts so read() returns them
+    void stop() {
+#if defined(__linux__)
+        for (int fd : fds)
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+
+    bool available(counter c) const { return fds[c] >= 0; }
+
+    // Count of c since start, 0 if it is unavailable
+    uint64_t read(counter c) const {
+        uint64_t value = 0;
+#if defined(__linux__)
+        if (fds[c] < 0 || ::read(fds[c], &value, sizeof(value)) != sizeof(value))
+            return 0;
+#endif
+        return value;
+    }
+
+    void print(std::ostream& out) const {
+        if (!available(cycles) && !available(cache_misses)) {
+            out << "-Perf counters: unavailable\n";
+            return;
+        }
+
+        double cycle_count = double(read(cycles));
+        double instruction_count = double(read(instructions));
+        double references = double(read(cache_references));
+        double misses = double(read(cache_misses));
+        if (available(cycles) && available(instructions) && cycle_count > 0)
+            out << "-Instructions per cycle: " << instruction_count / cycle_count << "\n";
+        if (available(cache_misses)) {
+            out << "-Cache misses: " << misses / 1e6 << "M";
+            if (available(cache_references) && references > 0)
+                out << " (" << 100.0 * misses / references << "% of references)";
+            out << "\n";
+        }
+    }
+
+   private:
+    int fds[counter_count];
+
+    void close_all() {
+#if defined(__linux__)
+        for (int& fd : fds) {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+#endif
+    }
+};
+
+#endif
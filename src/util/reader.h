@@ -9,9 +9,23 @@
 
 #include "../geometry/mesh.h"
 #include "../geometry/tri.h"
+#include "../util/task_graph.h"
+#include "../util/thread_pool.h"
 #include "../util/utils.h"
 
-void handleVertex(std::vector<point3>& vertices, const std::string& line) {
+// A material read from a material file, not yet added to MATERIALS
+struct named_material {
+    std::string name;
+    shared_ptr<material> mat;
+};
+
+// What readObj reads from an OBJ file and the material files it names
+struct obj_file {
+    std::vector<shared_ptr<triangle>> tris;
+    std::vector<named_material> materials;  // In the order the files list them
+};
+
+point3 parseVertex(const std::string& line) {
     std::istringstream stream(line);
     double x, y, z;
 
@@ -21,10 +35,10 @@ void handleVertex(std::vector<point3>& vertices, const std::string& line) {
         throw std::runtime_error("Failed to parse vertex line: " + line);
     }
 
-    vertices.push_back(point3(x, y, z));
+    return point3(x, y, z);
 }
 
-void handleVertexTexture(std::vector<point3>& uvs, const std::string& line) {
+point3 parseVertexTexture(const std::string& line) {
     std::istringstream stream(line);
     double u, v;
 
@@ -34,13 +48,17 @@ void handleVertexTexture(std::vector<point3>& uvs, const std::string& line) {
         throw std::runtime_error("Failed to parse texture vertex line: " + line);
     }
 
-    uvs.push_back(point3(u, v, 0));
+    return point3(u, v, 0);
 };
 
-void handleParseMaterial(std::ifstream& file, const std::string& mat_name, const std::filesystem::path& directory) {
+// Reads one newmtl block into materials. With a task graph, its texture files are decoded by tasks
+// added to it instead of before returning.
+void handleParseMaterial(std::ifstream& file, const std::string& mat_name, const std::filesystem::path& directory,
+                         std::vector<named_material>& materials, task_graph* textures) {
     std::clog << "Parsing material: " << mat_name << '\n';
 
     shared_ptr<material> mat = nullptr;
+    color emission(0, 0, 0);
 
     while (true) {
         std::string line;
@@ -61,6 +79,14 @@ void handleParseMaterial(std::ifstream& file, const std::string& mat_name, const
             }
             mat = make_shared<lambertian>(color(r, g, b));
         }
+        if (line.rfind("Ke", 0) == 0) {
+            std::istringstream ss(line.substr(3));
+            double r, g, b;
+            if (!(ss >> r >> g >> b)) {
+                throw std::runtime_error("Failed to parse Ke color in material: " + mat_name);
+            }
+            emission = color(r, g, b);
+        }
         if (line.rfind("map_Kd", 0) == 0) {
             std::string texture_file = line.substr(7);
             // Here you can load the texture file if needed
@@ -69,7 +95,13 @@ void handleParseMaterial(std::ifstream& file, const std::string& mat_name, const
 
             std::filesystem::path path = directory / texture_file;
             std::clog << "Full texture path: " << path.string() << '\n';
-            mat = make_shared<texture_lambertian>(path.string());
+            if (textures) {
+                auto texture = make_shared<texture_lambertian>();
+                textures->add([texture, path] { texture->set_texture(path.string()); });
+                mat = texture;
+            } else {
+                mat = make_shared<texture_lambertian>(path.string());
+            }
         }
         if (line.rfind("map_Bump", 0) == 0) {
             std::string bump_file = line.substr(22);
@@ -79,19 +111,28 @@ void handleParseMaterial(std::ifstream& file, const std::string& mat_name, const
 
             std::filesystem::path path = directory / bump_file;
             std::clog << "Full bump path: " << path.string() << '\n';
-            std::dynamic_pointer_cast<texture_lambertian>(mat)->set_normal(path.string());
+            auto texture = std::dynamic_pointer_cast<texture_lambertian>(mat);
+            if (textures)
+                textures->add([texture, path] { texture->set_normal(path.string()); });
+            else
+                texture->set_normal(path.string());
         }
     }
 
+    if (!emission.near_zero()) {
+        std::clog << "Material " << mat_name << " is emissive: " << emission << '\n';
+        mat = make_shared<diffuse_light>(emission);
+    }
+
     if (mat == nullptr) {
         std::clog << "No valid material found for " << mat_name << ", using default lambertian.\n";
         mat = make_shared<lambertian>(color(1, 0, 1));  // Default to a purple color
     }
 
-    add_material(mat_name, mat);
+    materials.push_back({mat_name, mat});
 }
 
-void handleMaterialFile(const std::filesystem::path& path) {
+void handleMaterialFile(const std::filesystem::path& path, std::vector<named_material>& materials, task_graph* textures) {
     std::ifstream file(path);
     if (!file.is_open()) {
         throw std::runtime_error("Failed to open material file: " + path.string());
@@ -101,7 +142,7 @@ void handleMaterialFile(const std::filesystem::path& path) {
     while (std::getline(file, line)) {
         // Process the material file line by line
         if (line.rfind("newmtl ", 0) == 0) {
-            handleParseMaterial(file, line.substr(7), path.parent_path());
+            handleParseMaterial(file, line.substr(7), path.parent_path(), materials, textures);
         }
         // You can add more processing for other material properties if needed
     }
@@ -109,12 +150,12 @@ void handleMaterialFile(const std::filesystem::path& path) {
     file.close();
 }
 
-void handleFace(
+shared_ptr<triangle> parseFace(
     const std::vector<point3>& vertices,
     const std::vector<point3>& uvs,
-    std::vector<shared_ptr<triangle>>& tris,
     const std::string& line,
-    const std::string& mat_name) {
+    const std::string& mat_name,
+    const shared_ptr<material>* mat_slot) {
     std::istringstream stream(line);
     std::string triplet;
     int indices[3];
@@ -161,48 +202,100 @@ void handleFace(
     point3 b = vertices[indices[1]];
     point3 c = vertices[indices[2]];
 
-    // Create and store the triangle
-    tris.push_back(make_shared<triangle>(a, b, c, mat_name, uvMappings));
+    // Create the triangle
+    return make_shared<triangle>(a, b, c, mat_name, mat_slot, uvMappings);
 }
 
-inline shared_ptr<mesh> readFile(std::string fileName) {
-    std::vector<point3> vertices;
-    std::vector<point3> uvs;
-    std::vector<shared_ptr<triangle>> tris;
+// Lines of a file parsed on the pool at a time
+const int OBJ_LINES_PER_JOB = 4096;
 
+// Reads the triangles and materials of an OBJ file. The materials aren't added to MATERIALS, so
+// files read side by side can still register theirs in a fixed order. With a task graph, texture
+// files are decoded by tasks added to it, which must finish before rendering.
+inline obj_file readObj(const std::string& fileName, task_graph* textures = nullptr) {
     std::ifstream file(fileName);
     if (!file.is_open()) {
         throw std::runtime_error("Failed to open file: " + fileName);
     }
 
+    obj_file obj;
     std::filesystem::path filePath(fileName);
     std::string line;
     std::string mat_name = "missing_texture";
 
+    // Materials are loaded as they come, the rest is only sorted by kind here and parsed on the
+    // pool below. Faces keep the material that was in use on their line.
+    std::vector<std::string> vertexLines;
+    std::vector<std::string> uvLines;
+    std::vector<std::string> faceLines;
+    std::vector<std::string> materialNames;
+    std::vector<int> faceMaterials;  // Index into materialNames of each face
+
     while (std::getline(file, line)) {
         if (line.rfind("v ", 0) == 0)
-            handleVertex(vertices, line.substr(2));
+            vertexLines.push_back(line.substr(2));
 
         // if (line.rfind("vn ", 0) == 0)
-        //     handleVertex(vertices, line.substr(3));
+        //     vertexLines.push_back(line.substr(3));
 
         if (line.rfind("vt ", 0) == 0)
-            handleVertexTexture(uvs, line.substr(3));
+            uvLines.push_back(line.substr(3));
 
         if (line.rfind("mtllib ", 0) == 0)
             // File name is the filename plus the current directory
-            handleMaterialFile(filePath.parent_path() / line.substr(7));
+            handleMaterialFile(filePath.parent_path() / line.substr(7), obj.materials, textures);
 
         if (line.rfind("usemtl", 0) == 0)
             mat_name = line.substr(7);
 
-        if (line.rfind("f ", 0) == 0)
-            handleFace(vertices, uvs, tris, line.substr(2), mat_name);
+        if (line.rfind("f ", 0) == 0) {
+            if (materialNames.empty() || materialNames.back() != mat_name)
+                materialNames.push_back(mat_name);
+            faceLines.push_back(line.substr(2));
+            faceMaterials.push_back(int(materialNames.size()) - 1);
+        }
     }
 
     file.close();
 
-    return make_shared<mesh>(tris);
+    ThreadPool& pool = shared_thread_pool();
+    std::vector<point3> vertices(vertexLines.size());
+    pool.parallel_for(0, int(vertexLines.size()), OBJ_LINES_PER_JOB, [&](int first, int last) {
+        for (int i = first; i < last; i++)
+            vertices[i] = parseVertex(vertexLines[i]);
+    });
+
+    std::vector<point3> uvs(uvLines.size());
+    pool.parallel_for(0, int(uvLines.size()), OBJ_LINES_PER_JOB, [&](int first, int last) {
+        for (int i = first; i < last; i++)
+            uvs[i] = parseVertexTexture(uvLines[i]);
+    });
+
+    // Each material's entry is looked up once here, rather than by every face under its lock
+    std::vector<const shared_ptr<material>*> materialSlots;
+    for (const std::string& name : materialNames)
+        materialSlots.push_back(material_slot(name));
+
+    // Faces only read the finished vertex lists
+    obj.tris.resize(faceLines.size());
+    pool.parallel_for(0, int(faceLines.size()), OBJ_LINES_PER_JOB, [&](int first, int last) {
+        for (int i = first; i < last; i++)
+            obj.tris[i] = parseFace(vertices, uvs, faceLines[i], materialNames[faceMaterials[i]], materialSlots[faceMaterials[i]]);
+    });
+
+    return obj;
+}
+
+// Adds the materials of obj to MATERIALS. Names already taken keep their first material.
+inline void registerMaterials(const obj_file& obj) {
+    for (const named_material& m : obj.materials)
+        add_material(m.name, m.mat);
+}
+
+inline shared_ptr<mesh> readFile(std::string fileName) {
+    obj_file obj = readObj(fileName);
+    registerMaterials(obj);
+    return make_shared<mesh>(obj.tris);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,158 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "../util/utils.h"
+#include "../util/vec3.h"
+
+// Closed form warps from the unit square to the shapes the renderer samples. Each one turns a pair
+// of numbers u1, u2 in [0,1) into exactly one sample without rejection, so every call uses the
+// same two random numbers and stratified or low discrepancy inputs stay well spread after the warp.
+
+// Point in the unit disk in the xy plane. Shirley and Chiu's concentric map keeps neighbouring
+// squares neighbouring on the disk, unlike the polar map. Written with selects instead of branches
+// so the batch loop below vectorizes.
+inline void concentric_disk(double u1, double u2, double& x, double& y) {
+    double a = 2 * u1 - 1;
+    double b = 2 * u2 - 1;
+    bool wide = std::fabs(a) > std::fabs(b);
+    double r = wide ? a : b;
+    double ratio = (wide ? b : a) / (r != 0 ? r : 1);
+    double phi = wide ? (pi / 4) * ratio : pi / 2 - (pi / 4) * ratio;
+    x = r * std::cos(phi);
+    y = r * std::sin(phi);
+}
+
+inline vec3 sample_concentric_disk(double u1, double u2) {
+    double x, y;
+    concentric_disk(u1, u2, x, y);
+    return vec3(x, y, 0);
+}
+
+// Unit vector uniform over the sphere
+inline void uniform_sphere(double u1, double u2, double& x, double& y, double& z) {
+    z = 1 - 2 * u1;
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * u2;
+    x = r * std::cos(phi);
+    y = r * std::sin(phi);
+}
+
+inline vec3 sample_uniform_sphere(double u1, double u2) {
+    double x, y, z;
+    uniform_sphere(u1, u2, x, y, z);
+    return vec3(x, y, z);
+}
+
+// Unit vector around +z with density cos(theta) / pi, by lifting a concentric disk point onto the
+// hemisphere (Malley's method)
+inline void cosine_hemisphere(double u1, double u2, double& x, double& y, double& z) {
+    concentric_disk(u1, u2, x, y);
+    z = std::sqrt(std::fmax(0.0, 1 - x * x - y * y));
+}
+
+// Unit vectors t and b that make a right handed frame with the unit vector n, without the branch
+// or normalization of the usual cross product construction (Duff et al. 2017)
+inline void orthonormal_basis(const vec3& n, vec3& t, vec3& b) {
+    double sign = std::copysign(1.0, n.z());
+    double a = -1 / (sign + n.z());
+    double c = n.x() * n.y() * a;
+    t = vec3(1 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+    b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+// Moves a direction given around +z into the frame around the unit vector n
+inline vec3 to_world(const vec3& n, double x, double y, double z) {
+    vec3 t, b;
+    orthonormal_basis(n, t, b);
+    return x * t + y * b + z * n;
+}
+
+// Unit vector around the unit normal n with density cos(theta) / pi, the same distribution as
+// n + random_unit_vector() without its normalization
+inline vec3 sample_cosine_hemisphere(const vec3& n, double u1, double u2) {
+    double x, y, z;
+    cosine_hemisphere(u1, u2, x, y, z);
+    return to_world(n, x, y, z);
+}
+
+// Microfacet normal around the unit normal n drawn from the GGX distribution with roughness alpha,
+// with density ggx_pdf(alpha, cos_theta) over solid angle. An alpha of 0 always gives n.
+inline vec3 sample_ggx_normal(const vec3& n, double alpha, double u1, double u2) {
+    double tan_squared = alpha * alpha * u1 / (1 - u1);
+    double cos_theta = 1 / std::sqrt(1 + tan_squared);
+    double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+    double phi = 2 * pi * u2;
+    return to_world(n, sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+inline double ggx_pdf(double alpha, double cos_theta) {
+    if (cos_theta <= 0 || alpha <= 0)
+        return 0;
+    double alpha_squared = alpha * alpha;
+    double denominator = cos_theta * cos_theta * (alpha_squared - 1) + 1;
+    return alpha_squared * cos_theta / (pi * denominator * denominator);
+}
+
+// Batch versions that warp count pairs of numbers at once into separate x, y and z arrays. The
+// loops have no branches or calls other than sqrt, sin and cos, so the compiler turns them into
+// SIMD code (the trigonometry needs -ffast-math or -fopenmp-simd to use the vector math library).
+
+inline void concentric_disk(int count, const double* u1, const double* u2, double* x, double* y) {
+    for (int i = 0; i < count; i++)
+        concentric_disk(u1[i], u2[i], x[i], y[i]);
+}
+
+inline void uniform_sphere(int count, const double* u1, const double* u2, double* x, double* y, double* z) {
+    for (int i = 0; i < count; i++)
+        uniform_sphere(u1[i], u2[i], x[i], y[i], z[i]);
+}
+
+inline void cosine_hemisphere(int count, const double* u1, const double* u2, double* x, double* y, double* z) {
+    for (int i = 0; i < count; i++)
+        cosine_hemisphere(u1[i], u2[i], x[i], y[i], z[i]);
+}
+
+// Fills u1 and u2 with count jittered points, one in each of count cells picked at random from a
+// grid as close to square as count allows, so the warps above receive stratified inputs. Every
+// cell is equally likely to be picked, so when count doesn't fill the grid the points still cover
+// the whole square evenly.
+inline void stratified_square(int count, double* u1, double* u2) {
+    int columns = std::max(1, int(std::ceil(std::sqrt(double(count)))));
+    int rows = std::max(1, (count + columns - 1) / columns);
+
+    // Selection sampling: each cell is taken with the chance the points still needed have of
+    // landing among the cells left
+    int cells = rows * columns;
+    int taken = 0;
+    for (int cell = 0; cell < cells && taken < count; cell++) {
+        if ((cells - cell) * random_double() >= count - taken)
+            continue;
+
+        u1[taken] = std::fmin((cell % columns + random_double()) / columns, 1 - 1e-12);
+        u2[taken] = std::fmin((cell / columns + random_double()) / rows, 1 - 1e-12);
+        taken++;
+    }
+}
+
+// Drop-in replacements for the old rejection loops
+
+inline vec3 random_in_unit_disk() {
+    return sample_concentric_disk(random_double(), random_double());
+}
+
+inline vec3 random_unit_vector() {
+    return sample_uniform_sphere(random_double(), random_double());
+}
+
+inline vec3 random_on_hemisphere(const vec3& normal) {
+    vec3 on_unit_sphere = random_unit_vector();
+    if (dot(on_unit_sphere, normal) > 0.0)  // In the same hemisphere as the normal
+        return on_unit_sphere;
+    else
+        return -on_unit_sphere;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include "utils.h"
+
+// Packs the grid cell holding p and a small tag in [0,8) into a non-zero key. Coordinates wrap
+// every 2^20 cells, far beyond any scene this renders.
+inline uint64_t grid_key(const point3& p, double cell_size, uint32_t tag = 0) {
+    auto quantize = [cell_size](double value) {
+        return uint64_t(int64_t(std::floor(value / cell_size)) & 0xfffff);
+    };
+    return ((quantize(p.x()) << 43) | (quantize(p.y()) << 23) | (quantize(p.z()) << 3) | (tag & 7)) + 1;
+}
+
+// std::atomic<float> has no fetch_add before C++20
+inline void atomic_add(std::atomic<float>& target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+    }
+}
+
+// Open addressed table of keys that any number of threads can look up and claim slots in at once.
+// Slots are never freed, so a slot index stays valid for its key until reset.
+class concurrent_key_table {
+   public:
+    void reset(int bits) {
+        this->bits = bits;
+        slot_count = size_t(1) << bits;
+        keys = std::make_unique<std::atomic<uint64_t>[]>(slot_count);
+        for (size_t i = 0; i < slot_count; i++)
+            keys[i] = 0;
+    }
+
+    size_t size() const { return slot_count; }
+
+    // Slot holding key, or -1 if it was never claimed
+    int find(uint64_t key) const {
+        for (int probe = 0; probe < MAX_PROBES; probe++) {
+            size_t slot = (home_slot(key) + probe) & (slot_count - 1);
+            uint64_t stored = keys[slot].load(std::memory_order_relaxed);
+            if (stored == key)
+                return int(slot);
+            if (stored == 0)
+                return -1;
+        }
+        return -1;
+    }
+
+    // Slot holding key, claiming a free one if needed. -1 if the neighbourhood is full.
+    int claim(uint64_t key) const {
+        for (int probe = 0; probe < MAX_PROBES; probe++) {
+            size_t slot = (home_slot(key) + probe) & (slot_count - 1);
+            uint64_t stored = 0;
+            if (keys[slot].compare_exchange_strong(stored, key) || stored == key)
+                return int(slot);
+        }
+        return -1;
+    }
+
+   private:
+    static const int MAX_PROBES = 8;  // Neighbouring slots tried when a key's own slot is taken
+
+    int bits = 0;
+    size_t slot_count = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> keys;  // 0 for free slots
+
+    size_t home_slot(uint64_t key) const {
+        return size_t((key * 0x9e3779b97f4a7c15ull) >> (64 - bits));
+    }
+};
+
+#endif
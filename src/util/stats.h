@@ -0,0 +1,126 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+
+// Off unless built with -DTRAVERSAL_STATS, since counting every node visit slows the render down
+#ifdef TRAVERSAL_STATS
+#define TRAVERSAL_STATS_ENABLED true
+#else
+#define TRAVERSAL_STATS_ENABLED false
+#endif
+
+// Off unless built with -DFRAMEBUFFER_STATS, since it counts the cache lines of every finished tile
+#ifdef FRAMEBUFFER_STATS
+#define FRAMEBUFFER_STATS_ENABLED true
+#else
+#define FRAMEBUFFER_STATS_ENABLED false
+#endif
+
+// Per-thread BVH traversal counters. Node visits are run through a small simulated direct-mapped
+// cache of node addresses, so the hit rate shows how much consecutive rays share the same nodes.
+class traversal_stats {
+   public:
+    static const int NODE_CACHE_SIZE = 512;  // Number of node addresses the simulated cache holds
+
+    uint64_t rays = 0;                    // Rays traced against the scene
+    uint64_t node_visits = 0;             // BVH nodes entered
+    uint64_t node_cache_hits = 0;         // Node visits that found the node in the simulated cache
+    uint64_t radiance_cache_lookups = 0;  // Paths that asked the radiance cache for the rest of their light
+    uint64_t radiance_cache_hits = 0;     // Lookups the radiance cache could answer
+    uint64_t primary_rays = 0;            // Camera rays, counted in rays too
+    uint64_t primary_node_visits = 0;     // Node visits of camera rays, counted in node_visits too
+    bool primary = false;                 // Whether the ray being traced is a camera ray
+
+    void record_ray() {
+        rays++;
+        if (primary)
+            primary_rays++;
+    }
+
+    void record_node(const void* node) {
+        node_visits++;
+        if (primary)
+            primary_node_visits++;
+
+        uintptr_t address = reinterpret_cast<uintptr_t>(node);
+        int line = int((address >> 4) % NODE_CACHE_SIZE);
+        if (node_cache[line] == node) {
+            node_cache_hits++;
+        } else {
+            node_cache[line] = node;
+        }
+    }
+
+    // Adds this thread's counters to the global totals and starts counting from zero again
+    void flush() {
+        total_rays += rays;
+        total_node_visits += node_visits;
+        total_node_cache_hits += node_cache_hits;
+        total_radiance_cache_lookups += radiance_cache_lookups;
+        total_radiance_cache_hits += radiance_cache_hits;
+        total_primary_rays += primary_rays;
+        total_primary_node_visits += primary_node_visits;
+        rays = 0;
+        node_visits = 0;
+        node_cache_hits = 0;
+        radiance_cache_lookups = 0;
+        radiance_cache_hits = 0;
+        primary_rays = 0;
+        primary_node_visits = 0;
+    }
+
+    static void reset_totals() {
+        total_rays = 0;
+        total_node_visits = 0;
+        total_node_cache_hits = 0;
+        total_radiance_cache_lookups = 0;
+        total_radiance_cache_hits = 0;
+        total_primary_rays = 0;
+        total_primary_node_visits = 0;
+    }
+
+    static inline std::atomic<uint64_t> total_rays{0};
+    static inline std::atomic<uint64_t> total_node_visits{0};
+    static inline std::atomic<uint64_t> total_node_cache_hits{0};
+    static inline std::atomic<uint64_t> total_radiance_cache_lookups{0};
+    static inline std::atomic<uint64_t> total_radiance_cache_hits{0};
+    static inline std::atomic<uint64_t> total_primary_rays{0};
+    static inline std::atomic<uint64_t> total_primary_node_visits{0};
+
+   private:
+    const void* node_cache[NODE_CACHE_SIZE] = {};
+};
+
+inline traversal_stats& local_traversal_stats() {
+    thread_local traversal_stats stats;
+    return stats;
+}
+
+// Cache lines of the accumulator written by finished tiles, and how many of them also hold pixels
+// of another tile, which two threads finishing neighbouring tiles at once would false share. The
+// same writes are counted for a scanline accumulator too, for comparison.
+class framebuffer_stats {
+   public:
+    static void record(uint64_t lines, uint64_t shared, uint64_t scanline_lines, uint64_t scanline_shared) {
+        total_lines += lines;
+        total_shared_lines += shared;
+        total_scanline_lines += scanline_lines;
+        total_scanline_shared_lines += scanline_shared;
+    }
+
+    static void reset_totals() {
+        total_lines = 0;
+        total_shared_lines = 0;
+        total_scanline_lines = 0;
+        total_scanline_shared_lines = 0;
+    }
+
+    static inline std::atomic<uint64_t> total_lines{0};
+    static inline std::atomic<uint64_t> total_shared_lines{0};
+    static inline std::atomic<uint64_t> total_scanline_lines{0};
+    static inline std::atomic<uint64_t> total_scanline_shared_lines{0};
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Tasks with dependencies, run on a ThreadPool as soon as everything they depend on is done, so
+// independent work like loading two meshes overlaps while dependent steps still wait their turn.
+// Running tasks may add more, for work they only discover once started, like the textures named
+// by a material file. Tasks can use the pool's parallel_for themselves.
+class task_graph {
+   public:
+    task_graph() {}
+
+    task_graph(const task_graph&) = delete;
+    task_graph& operator=(const task_graph&) = delete;
+
+    // Adds fn to run once every task in after is done, and returns its id for later tasks to
+    // depend on. Tasks added while the graph runs are queued right away if they are ready.
+    int add(std::function<void()> fn, const std::vector<int>& after = {}) {
+        int id;
+        bool ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            id = int(tasks.size());
+            tasks.emplace_back();
+            task& t = tasks.back();
+            t.fn = std::move(fn);
+            for (int dependency : after) {
+                if (tasks[dependency].finished)
+                    continue;
+                tasks[dependency].dependents.push_back(id);
+                t.waiting++;
+            }
+            unfinished++;
+            ready = pool && t.waiting == 0;
+            if (ready)
+                t.queued = true;
+        }
+
+        if (ready)
+            Schedule(id);
+        return id;
+    }
+
+    // Runs every task on pool and returns once all of them are done, including any added while
+    // they ran. Must be called from outside the pool, as it blocks while waiting. Rethrows the
+    // first exception a task threw, tasks not yet started when it was thrown are skipped.
+    void run(ThreadPool& threadPool) {
+        std::vector<int> ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pool = &threadPool;
+            error = nullptr;
+            for (int id = 0; id < int(tasks.size()); id++) {
+                if (!tasks[id].finished && !tasks[id].queued && tasks[id].waiting == 0) {
+                    tasks[id].queued = true;
+                    ready.push_back(id);
+                }
+            }
+        }
+
+        for (int id : ready)
+            Schedule(id);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [this] { return unfinished == 0; });
+        pool = nullptr;
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+   private:
+    struct task {
+        std::function<void()> fn;
+        std::vector<int> dependents;  // Tasks waiting on this one
+        int waiting = 0;              // Dependencies not yet done
+        bool queued = false;          // Handed to the pool
+        bool finished = false;
+    };
+
+    std::mutex mutex;                   // Guards everything below
+    std::condition_variable all_done;   // Signalled when unfinished reaches zero
+    std::deque<task> tasks;             // A deque so running tasks keep their place while more are added
+    int unfinished = 0;                 // Tasks added that haven't finished
+    ThreadPool* pool = nullptr;         // Pool of the current run, null outside run
+    std::exception_ptr error;           // First exception a task threw this run
+
+    void Schedule(int id) {
+        pool->QueueJob([this, id] { Execute(id); });
+    }
+
+    void Execute(int id) {
+        std::function<void()> fn;
+        bool skip;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            fn = std::move(tasks[id].fn);
+            skip = bool(error);
+        }
+
+        if (!skip) {
+            try {
+                fn();
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        fn = nullptr;  // Release what the task captured before counting it done
+
+        std::vector<int> ready;
+        std::unique_lock<std::mutex> lock(mutex);
+        task& t = tasks[id];
+        t.finished = true;
+        for (int dependent : t.dependents) {
+            if (--tasks[dependent].waiting == 0) {
+                tasks[dependent].queued = true;
+                ready.push_back(dependent);
+            }
+        }
+
+        // Queued under the lock, since once the last task is counted run may return and the
+        // graph may be gone
+        for (int dependent : ready)
+            Schedule(dependent);
+        if (--unfinished == 0)
+            all_done.notify_all();
+    }
+};
+
+#endif
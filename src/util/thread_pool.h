@@ -1,85 +1,521 @@
-#ifndef THREAD_POOL_H
-#define THREAD_POOL_H
-
-#include <condition_variable>
-#include <functional>
-#include <mutex>
-#include <queue>
-#include <thread>
-#include <vector>
-
-#define MULTITHEADING_ENABLED true
-
-class ThreadPool {
-   public:
-    // Takes in num threads and callback
-    ThreadPool() {}
-
-    void Start() {
-        const uint32_t num_threads = MULTITHEADING_ENABLED ? std::thread::hardware_concurrency() : 1;
-        for (uint32_t ii = 0; ii < num_threads; ++ii) {
-            threads.emplace_back(std::thread(&ThreadPool::ThreadLoop, this));
-        }
-    }
-
-    void QueueJob(std::function<void()> job) {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            jobs.push(std::move(job));
-        }
-        mutex_condition.notify_one();
-    }
-
-    bool busy() {
-        bool poolbusy;
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            poolbusy = !jobs.empty();
-        }
-        return poolbusy;
-    }
-
-    int size() {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        return jobs.size();
-    }
-
-    void Stop() {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            should_terminate = true;
-        }
-        mutex_condition.notify_all();
-        for (std::thread& active_thread : threads) {
-            active_thread.join();
-        }
-        threads.clear();
-    }
-
-   private:
-    void ThreadLoop() {
-        while (true) {
-            std::function<void()> job;
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                mutex_condition.wait(lock, [this] {
-                    return !jobs.empty() || should_terminate;
-                });
-                if (should_terminate) {
-                    return;
-                }
-                job = jobs.front();
-                jobs.pop();
-            }
-            job();
-        }
-    }
-
-    bool should_terminate = false;            // Tells threads to stop looking for jobs
-    std::mutex queue_mutex;                   // Prevents data races to the job queue
-    std::condition_variable mutex_condition;  // Allows threads to wait on new jobs or termination
-    std::vector<std::thread> threads;
-    std::queue<std::function<void()>> jobs;
-};
-
-#endif
\ No newline at end of file
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "alloc_tracking.h"
+#include "cpu_topology.h"
+#include "work_deque.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define MULTITHEADING_ENABLED true
+
+// What the pool's deques hold. The pool only calls run, whoever queued the job decides where it
+// lives and when it is freed, so jobs can sit inside the frame of a caller that waits for them.
+// run is called with execute false for jobs dropped by Stop.
+struct pool_job {
+    void (*run)(pool_job* job, bool execute) = nullptr;
+};
+
+// Work stealing pool. Every worker has its own lock-free deque: jobs queued from a worker go on
+// its own deque and it runs them newest first, which keeps split up work on the core whose cache
+// holds it. Jobs queued from outside the pool go on a shared deque. A worker that runs out takes
+// from the shared deque or steals the oldest job of a random other worker, so there is no lock on
+// the path a job takes through the pool. Workers with nothing to do spin briefly, then yield, then
+// sleep until more jobs are queued.
+//
+// parallel_for and parallel_reduce split a range into chunks that the caller and the workers take
+// turns claiming, and return once every chunk is done. They allocate nothing per chunk, and a
+// caller waiting for its chunks runs other queued jobs meanwhile, so they can be nested inside
+// each other and inside jobs.
+class ThreadPool {
+   public:
+    // Takes in num threads and callback
+    ThreadPool() {}
+
+    ~ThreadPool() {
+        if (!threads.empty())
+            Stop();
+        while (queued_job* record = free_records) {
+            free_records = record->next_free;
+            delete record;
+        }
+    }
+
+    // Starts num_threads workers, or one per hardware thread for 0. With an affinity policy each
+    // worker is pinned to its own CPU, and with skip_smt_siblings the default count is one per
+    // physical core, since two threads tracing rays on one core mostly wait on each other.
+    void Start(int num_threads = 0, affinity_policy affinity = affinity_policy::none, bool skip_smt_siblings = true) {
+        const cpu_topology& topology = cpu_topology::get();
+        if (!MULTITHEADING_ENABLED)
+            num_threads = 1;
+        else if (num_threads <= 0 && affinity != affinity_policy::none && skip_smt_siblings)
+            num_threads = std::max(1, topology.primary_thread_count());
+        else if (num_threads <= 0)
+            num_threads = int(std::max(1u, std::thread::hardware_concurrency()));
+
+        std::vector<cpu_info> cpus = topology.placement(affinity, num_threads, skip_smt_siblings);
+        should_terminate = false;
+        workers.clear();
+        for (int ii = 0; ii < num_threads; ++ii)
+            workers.emplace_back(std::make_unique<worker>());
+        for (int ii = 0; ii < num_threads; ++ii) {
+            const cpu_info* cpu = cpus.empty() ? nullptr : &cpus[ii];
+            threads.emplace_back(std::thread(&ThreadPool::ThreadLoop, this, ii, cpu ? *cpu : cpu_info{-1, -1, -1, false}));
+        }
+    }
+
+    // Runs job on some worker. The callable is moved into a job record the pool reuses, so this
+    // allocates only while the pool has fewer records than jobs in flight, or for callables bigger
+    // than JOB_BYTES.
+    template <typename F>
+    void QueueJob(F&& job) {
+        using Fn = std::decay_t<F>;
+        queued_job* record = TakeRecord();
+        if constexpr (sizeof(Fn) <= JOB_BYTES && alignof(Fn) <= alignof(std::max_align_t)) {
+            ::new (static_cast<void*>(record->storage)) Fn(std::forward<F>(job));
+            record->call = [](void* storage, bool execute) {
+                Fn& fn = *static_cast<Fn*>(storage);
+                if (execute)
+                    fn();
+                fn.~Fn();
+            };
+        } else {
+            ::new (static_cast<void*>(record->storage)) Fn*(new Fn(std::forward<F>(job)));
+            record->call = [](void* storage, bool execute) {
+                Fn* fn = *static_cast<Fn**>(storage);
+                if (execute)
+                    (*fn)();
+                delete fn;
+            };
+        }
+        Push(record);
+    }
+
+    // Whether jobs are queued that no worker has started yet
+    bool busy() {
+        return jobs_queued.load(std::memory_order_relaxed) > 0;
+    }
+
+    int size() {
+        return jobs_queued.load(std::memory_order_relaxed);
+    }
+
+    // Number of workers, 0 before Start
+    int thread_count() const {
+        return int(threads.size());
+    }
+
+    // Index of the calling thread among the workers, -1 for threads outside the pool
+    int worker_index() const {
+        return current_worker_index();
+    }
+
+    // Calls fn(first, last) over [begin, end) in chunks of grain items, or an automatic size for
+    // grain <= 0, and returns when all of them are done. Rethrows the first exception fn threw,
+    // chunks not yet started when it was thrown are skipped.
+    template <typename Fn>
+    void parallel_for(int begin, int end, int grain, const Fn& fn) {
+        if (end <= begin)
+            return;
+        if (grain <= 0)
+            grain = std::max(1, (end - begin) / (8 * std::max(thread_count(), 1)));
+
+        int chunk_count = (end - begin + grain - 1) / grain;
+        if (chunk_count == 1 || threads.empty()) {
+            fn(begin, end);
+            return;
+        }
+
+        range_task task;
+        task.begin = begin;
+        task.end = end;
+        task.grain = grain;
+        task.chunk_count = chunk_count;
+        task.fn = &fn;
+        task.run_chunk = [](const void* f, int first, int last) { (*static_cast<const Fn*>(f))(first, last); };
+        RunRange(task);
+    }
+
+    // Splits [begin, end) like parallel_for, maps each chunk to a value with map(first, last) and
+    // folds the values with combine in chunk order, so the result doesn't depend on which thread
+    // ran what
+    template <typename T, typename Map, typename Combine>
+    T parallel_reduce(int begin, int end, int grain, T identity, const Map& map, const Combine& combine) {
+        if (end <= begin)
+            return identity;
+        if (grain <= 0)
+            grain = std::max(1, (end - begin) / (8 * std::max(thread_count(), 1)));
+
+        // Chunk values, on the stack unless there are more than a few
+        int chunk_count = (end - begin + grain - 1) / grain;
+        std::array<T, INLINE_PARTIALS> inline_partial;
+        std::vector<T> heap_partial;
+        T* partial = inline_partial.data();
+        if (chunk_count > INLINE_PARTIALS) {
+            heap_partial.assign(chunk_count, identity);
+            partial = heap_partial.data();
+        } else {
+            std::fill_n(partial, chunk_count, identity);
+        }
+
+        parallel_for(0, chunk_count, 1, [&](int first_chunk, int last_chunk) {
+            for (int c = first_chunk; c < last_chunk; c++)
+                partial[c] = map(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+        });
+
+        T result = identity;
+        for (int c = 0; c < chunk_count; c++)
+            result = combine(result, partial[c]);
+        return result;
+    }
+
+    void Stop() {
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            should_terminate = true;
+            wake_generation++;
+        }
+        mutex_condition.notify_all();
+        for (std::thread& active_thread : threads) {
+            active_thread.join();
+        }
+        threads.clear();
+
+        // Drop jobs that never ran, as the single queue pool did. Only QueueJob's jobs are left
+        // here, parallel_for waits for its own.
+        while (pool_job* job = submitted.steal())
+            Discard(job);
+        for (auto& w : workers)
+            while (pool_job* job = w->jobs.steal())
+                Discard(job);
+        jobs_queued = 0;
+    }
+
+   private:
+    static const int SPIN_ROUNDS = 64;   // Failed searches spent spinning before yielding
+    static const int YIELD_ROUNDS = 16;  // Failed searches spent yielding before sleeping
+    static const int MAX_HELPERS = 256;  // Workers a single parallel_for hands chunks to
+    static const int JOB_BYTES = 64;       // Callables QueueJob stores inside its job records
+    static const int INLINE_PARTIALS = 16;  // Chunk values parallel_reduce keeps on the stack
+
+    struct worker {
+        work_deque<pool_job> jobs;
+    };
+
+    // A QueueJob callable, stored in place or, if too big, on the heap. Goes back on the pool's
+    // free list once it has run.
+    struct queued_job : pool_job {
+        alignas(std::max_align_t) unsigned char storage[JOB_BYTES];
+        void (*call)(void* storage, bool execute);  // Runs the callable if execute, then destroys it
+        alloc_context context;                      // Of the thread that queued it
+        ThreadPool* owner;
+        queued_job* next_free = nullptr;
+
+        static void Run(pool_job* job, bool execute) {
+            auto* self = static_cast<queued_job*>(job);
+            {
+                alloc_tracking::context_scope queuer(self->context);
+                self->call(self->storage, execute);
+            }
+            self->owner->ReturnRecord(self);
+        }
+    };
+
+    // One parallel_for call. Lives in the caller's frame until every helper queued for it is done.
+    struct range_task {
+        struct helper : pool_job {
+            range_task* task;
+        };
+
+        int begin, end, grain, chunk_count;
+        alloc_context context = ALLOC_TRACKING_ENABLED ? alloc_tracking::thread_context() : alloc_context();  // Of the calling thread, for the helpers
+        const void* fn;
+        void (*run_chunk)(const void* fn, int first, int last);
+
+        std::atomic<int> next_chunk{0};
+        std::atomic<int> helpers_running{0};  // Helpers queued that haven't finished
+        std::mutex done_mutex;                // Held by helpers while they count themselves done
+        std::condition_variable done;         // Signalled when helpers_running reaches zero
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        helper helpers[MAX_HELPERS];
+
+        // Claims and runs chunks until there are none left
+        void work() {
+            while (!failed.load(std::memory_order_relaxed)) {
+                int chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+                if (chunk >= chunk_count)
+                    return;
+
+                int first = begin + chunk * grain;
+                try {
+                    run_chunk(fn, first, std::min(end, first + grain));
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    failed = true;
+                }
+            }
+        }
+    };
+
+    // Which pool and worker the calling thread is, so jobs queued from inside a job stay local
+    struct worker_identity {
+        const ThreadPool* pool = nullptr;
+        int index = -1;
+    };
+
+    static worker_identity& current_worker() {
+        thread_local worker_identity identity;
+        return identity;
+    }
+
+    int current_worker_index() const {
+        const worker_identity& identity = current_worker();
+        return identity.pool == this ? identity.index : -1;
+    }
+
+    // A free job record, or a new one if none are left. Records are few and short lived, so a
+    // lock around the list costs less than the allocation it saves.
+    queued_job* TakeRecord() {
+        queued_job* record;
+        {
+            std::unique_lock<std::mutex> lock(record_mutex);
+            record = free_records;
+            if (record)
+                free_records = record->next_free;
+        }
+
+        if (!record) {
+            record = new queued_job();
+            record->run = &queued_job::Run;
+            record->owner = this;
+        }
+        record->context = ALLOC_TRACKING_ENABLED ? alloc_tracking::thread_context() : alloc_context();
+        return record;
+    }
+
+    void ReturnRecord(queued_job* record) {
+        std::unique_lock<std::mutex> lock(record_mutex);
+        record->next_free = free_records;
+        free_records = record;
+    }
+
+    void Push(pool_job* job) {
+        jobs_queued.fetch_add(1, std::memory_order_relaxed);
+
+        int index = current_worker_index();
+        if (index >= 0) {
+            workers[index]->jobs.push(job);
+        } else {
+            // The shared deque has one owner end, so outside threads take turns pushing
+            std::unique_lock<std::mutex> lock(submit_mutex);
+            submitted.push(job);
+        }
+
+        // Pairs with the fence in Sleep: either the sleeper sees the new job or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) > 0) {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake_generation++;
+            mutex_condition.notify_one();
+        }
+    }
+
+    void Run(pool_job* job) {
+        jobs_queued.fetch_sub(1, std::memory_order_relaxed);
+        job->run(job, true);
+    }
+
+    static void Discard(pool_job* job) {
+        job->run(job, false);
+    }
+
+    void RunRange(range_task& task) {
+        int helper_count = std::min({thread_count(), task.chunk_count - 1, MAX_HELPERS});
+        task.helpers_running = helper_count;
+        for (int i = 0; i < helper_count; i++) {
+            range_task::helper& h = task.helpers[i];
+            h.task = &task;
+            h.run = [](pool_job* job, bool execute) {
+                range_task* t = static_cast<range_task::helper*>(job)->task;
+                if (execute) {
+                    alloc_tracking::context_scope caller(t->context);
+                    t->work();
+                }
+
+                // Counted under the lock, so the caller can't return and free the task while
+                // this helper still touches it
+                std::unique_lock<std::mutex> lock(t->done_mutex);
+                if (--t->helpers_running == 0)
+                    t->done.notify_all();
+            };
+            Push(&h);
+        }
+
+        task.work();
+        WaitFor(task);
+
+        if (task.error)
+            std::rethrow_exception(task.error);
+    }
+
+    // Runs other jobs until every helper of task is done, blocking when there are none to run
+    void WaitFor(range_task& task) {
+        int index = current_worker_index();
+        uint64_t rng = reinterpret_cast<uintptr_t>(&task) | 1;
+        int idle_rounds = 0;
+        while (task.helpers_running.load(std::memory_order_acquire) > 0) {
+            if (pool_job* job = FindJob(index, rng)) {
+                idle_rounds = 0;
+                Run(job);
+                continue;
+            }
+
+            // The remaining helpers are running elsewhere. Spin a little in case they are nearly
+            // done, then block, waking now and then to help with anything queued meanwhile.
+            idle_rounds++;
+            if (idle_rounds <= SPIN_ROUNDS) {
+                Pause();
+            } else {
+                std::unique_lock<std::mutex> lock(task.done_mutex);
+                task.done.wait_for(lock, std::chrono::milliseconds(1), [&task] {
+                    return task.helpers_running.load(std::memory_order_relaxed) == 0;
+                });
+            }
+        }
+
+        // The last helper may still hold the lock it counted itself done under
+        std::unique_lock<std::mutex> lock(task.done_mutex);
+    }
+
+    void ThreadLoop(int index, cpu_info cpu) {
+        current_worker() = {this, index};
+        if (cpu.cpu >= 0)
+            pin_current_thread(cpu);
+        uint64_t rng = 0x9e3779b97f4a7c15ull * uint64_t(index + 1);  // xorshift state for picking victims
+
+        int idle_rounds = 0;
+        while (!should_terminate.load(std::memory_order_relaxed)) {
+            pool_job* job = FindJob(index, rng);
+            if (job) {
+                idle_rounds = 0;
+                Run(job);
+                continue;
+            }
+
+            // Back off: spin, then give the core away, then sleep until something is queued
+            idle_rounds++;
+            if (idle_rounds <= SPIN_ROUNDS)
+                Pause();
+            else if (idle_rounds <= SPIN_ROUNDS + YIELD_ROUNDS)
+                std::this_thread::yield();
+            else {
+                Sleep();
+                idle_rounds = 0;
+            }
+        }
+        current_worker() = {};
+        current_numa_node() = -1;
+    }
+
+    // Own deque newest first, then the shared deque, then the other workers from a random start.
+    // Threads outside the pool pass index -1 and only steal.
+    pool_job* FindJob(int index, uint64_t& rng) {
+        if (index >= 0)
+            if (pool_job* job = workers[index]->jobs.take())
+                return job;
+        if (pool_job* job = submitted.steal())
+            return job;
+
+        int count = int(workers.size());
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        int start = int(rng % uint64_t(count));
+        for (int i = 0; i < count; i++) {
+            int victim = (start + i) % count;
+            if (victim == index)
+                continue;
+            if (pool_job* job = workers[victim]->jobs.steal())
+                return job;
+        }
+        return nullptr;
+    }
+
+    bool AnyQueued() const {
+        if (!submitted.empty())
+            return true;
+        for (const auto& w : workers)
+            if (!w->jobs.empty())
+                return true;
+        return false;
+    }
+
+    void Sleep() {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Look once more now that queuers know to wake us, so a job queued just before isn't missed
+        uint64_t generation = wake_generation;
+        if (!AnyQueued() && !should_terminate)
+            mutex_condition.wait(lock, [this, generation] {
+                return wake_generation != generation || should_terminate;
+            });
+
+        sleeping.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    std::atomic<bool> should_terminate{false};  // Tells threads to stop looking for jobs
+    std::vector<std::unique_ptr<worker>> workers;
+    work_deque<pool_job> submitted;   // Jobs queued from threads outside the pool
+    std::mutex submit_mutex;          // Serializes pushes onto submitted
+    std::atomic<int> jobs_queued{0};  // Queued jobs no worker has started yet
+    std::mutex record_mutex;            // Guards free_records
+    queued_job* free_records = nullptr;  // QueueJob records not in use, linked by next_free
+
+    std::mutex sleep_mutex;                   // Guards wake_generation and sleeping workers' waits
+    std::condition_variable mutex_condition;  // Allows idle threads to wait on new jobs or termination
+    std::atomic<int> sleeping{0};             // Workers waiting on mutex_condition
+    uint64_t wake_generation = 0;             // Bumped whenever sleepers should look for jobs again
+    std::vector<std::thread> threads;
+};
+
+// Pool for work outside a render, like loading and building meshes. Started on first use.
+inline ThreadPool& shared_thread_pool() {
+    static ThreadPool pool;
+    static std::once_flag started;
+    std::call_once(started, [] { pool.Start(); });
+    return pool;
+}
+
+#endif
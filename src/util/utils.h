@@ -2,11 +2,11 @@
 #define UTILS_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <random>
 
 // C++ Std Usings
 
@@ -25,19 +25,52 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-static std::mt19937& global_rng() {
-    thread_local std::mt19937 rng{[] {
-        std::random_device rd;
-        std::seed_seq ss{rd(), rd(), rd(), rd()};
-        return std::mt19937{ss};
-    }()};
-    return rng;
+// Counter-based random numbers. A stream is a key naming what the numbers are for and a counter
+// of how many it has handed out. The n-th number of a stream is a hash of the key and n, so a
+// render draws the same numbers whichever thread or order its samples run in, and any number can
+// be made on its own without stepping through the ones before it.
+struct random_stream {
+    uint64_t key = 0;
+    uint32_t counter = 0;  // Dimension of the next number, counting from 0
+
+    // An independent stream for the i-th branch of a path split from this one
+    random_stream branch(uint32_t i) const {
+        return {mix_bits(key ^ (0x9e3779b97f4a7c15ull * (uint64_t(i) + 1))), 0};
+    }
+
+    // SplitMix64 finalizer, which turns consecutive inputs into unrelated outputs
+    static uint64_t mix_bits(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+// Random bits number dimension of the stream with the given key
+inline uint64_t random_bits(uint64_t key, uint32_t dimension) {
+    return random_stream::mix_bits(key + 0x9e3779b97f4a7c15ull * (uint64_t(dimension) + 1));
+}
+
+// The stream random_double() draws from on this thread
+inline random_stream& current_random_stream() {
+    thread_local random_stream stream;
+    return stream;
+}
+
+// Starts this thread on the stream for one sample of one pixel of one frame. domain keeps streams
+// used for different things, like camera paths and photons, apart.
+inline void seed_random(uint64_t pixel, uint64_t sample, uint64_t frame = 0, uint64_t domain = 0) {
+    uint64_t key = random_stream::mix_bits(domain + 0x632be59bd9b4e019ull);
+    key = random_stream::mix_bits(key ^ frame);
+    key = random_stream::mix_bits(key ^ sample);
+    key = random_stream::mix_bits(key ^ pixel);
+    current_random_stream() = {key, 0};
 }
 
 inline double random_double() {
     // Returns a random real in [0,1).
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);  // Define the range
-    return distribution(global_rng());
+    random_stream& stream = current_random_stream();
+    return (random_bits(stream.key, stream.counter++) >> 11) * 0x1.0p-53;
 }
 
 inline double random_double(double min, double max) {
@@ -50,5 +83,6 @@ inline double random_double(double min, double max) {
 #include "../scene/ray.h"
 #include "../util/interval.h"
 #include "../util/vec3.h"
+#include "../util/sampling.h"
 
 #endif
\ No newline at end of file
@@ -1,60 +1,71 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include <type_traits>
+
 #include "../util/utils.h"
 
-class vec3 {
+// Three component vector stored in four lanes, the last always 0, so a whole vector is one SSE
+// register for float and one AVX register (two SSE registers without AVX) for double. Arithmetic
+// works on all lanes at once through GCC vector extensions. The type is trivially copyable, so
+// arrays of points and colors can be memcpy'd and vectorized.
+template <typename T>
+class basic_vec3 {
    public:
-    double e[3];
+    typedef T scalar;
+    typedef T lanes __attribute__((vector_size(4 * sizeof(T))));
+
+    lanes e;
 
-    vec3() : e{0, 0, 0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
-    vec3(const vec3& v) : e{v.x(), v.y(), v.z()} {}
+    basic_vec3() : e{0, 0, 0, 0} {}
+    basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2, 0} {}
+    explicit basic_vec3(const lanes& e) : e(e) {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    // Converts between the float and double variants
+    template <typename U>
+    explicit basic_vec3(const basic_vec3<U>& v) : e(__builtin_convertvector(v.e, lanes)) {}
 
-    void setX(double x) {
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    void setX(T x) {
         e[0] = x;
     }
 
-    void setY(double y) {
+    void setY(T y) {
         e[1] = y;
     }
 
-    void setZ(double z) {
+    void setZ(T z) {
         e[2] = z;
     }
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    basic_vec3 operator-() const { return basic_vec3(-e); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return reinterpret_cast<T*>(&e)[i]; }
 
-    vec3& operator+=(const vec3& v) {
-        e[0] += v.e[0];
-        e[1] += v.e[1];
-        e[2] += v.e[2];
+    basic_vec3& operator+=(const basic_vec3& v) {
+        e += v.e;
         return *this;
     }
 
-    vec3& operator*=(double t) {
-        e[0] *= t;
-        e[1] *= t;
-        e[2] *= t;
+    basic_vec3& operator*=(T t) {
+        e *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
+    basic_vec3& operator/=(T t) {
         return *this *= 1 / t;
     }
 
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
-        return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+    T length_squared() const {
+        lanes squared = e * e;
+        return squared[0] + squared[1] + squared[2];
     }
 
     bool near_zero() const {
@@ -63,104 +74,102 @@ class vec3 {
         return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 
-    static vec3 random() {
-        return vec3(random_double(), random_double(), random_double());
+    static basic_vec3 random() {
+        return basic_vec3(T(random_double()), T(random_double()), T(random_double()));
     }
 
-    static vec3 random(double min, double max) {
-        return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+    static basic_vec3 random(double min, double max) {
+        return basic_vec3(T(random_double(min, max)), T(random_double(min, max)), T(random_double(min, max)));
     }
 };
 
+using vec3 = basic_vec3<double>;
+using vec3f = basic_vec3<float>;  // Half the memory and twice the lanes per register, for bulk data
+
+static_assert(std::is_trivially_copyable<vec3>::value, "vec3 must stay trivially copyable");
+static_assert(std::is_trivially_copyable<vec3f>::value, "vec3f must stay trivially copyable");
+
 // point3 is just an alias for vec3, but useful for geometric clarity in the code.
 using point3 = vec3;
 
-// Vector Utility Functions
+// Vector Utility Functions. Scalars are taken as the vector's own type so that 0.5 * v works for
+// both variants.
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const basic_vec3<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator+(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e + v.e);
 }
 
-inline vec3 operator-(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator-(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e - v.e);
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e * v.e);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator*(typename basic_vec3<T>::scalar t, const basic_vec3<T>& v) {
+    return basic_vec3<T>(t * v.e);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& v, typename basic_vec3<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+template <typename T>
+inline basic_vec3<T> operator/(const basic_vec3<T>& v, typename basic_vec3<T>::scalar t) {
     return (1 / t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
-    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+template <typename T>
+inline T dot(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    typename basic_vec3<T>::lanes product = u.e * v.e;
+    return product[0] + product[1] + product[2];
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                         u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(const vec3& v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(const basic_vec3<T>& v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
-}
-
-inline vec3 random_unit_vector() {
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        if (1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
-}
-
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) > 0.0)  // In the same hemisphere as the normal
-        return on_unit_sphere;
-    else
-        return -on_unit_sphere;
-}
-
-inline vec3 reflect(const vec3& v, const vec3& n) {
+template <typename T>
+inline basic_vec3<T> reflect(const basic_vec3<T>& v, const basic_vec3<T>& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
-    vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+template <typename T>
+inline basic_vec3<T> refract(const basic_vec3<T>& uv, const basic_vec3<T>& n, typename basic_vec3<T>::scalar etai_over_etat) {
+    T cos_theta = std::fmin(dot(-uv, n), T(1));
+    basic_vec3<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+    basic_vec3<T> r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
-inline vec3 vec_min(const vec3& a, const vec3& b) {
-    return vec3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
+// Lane-wise minimum and maximum. Like fmin and fmax, a NaN lane in a takes b's value.
+template <typename T>
+inline basic_vec3<T> vec_min(const basic_vec3<T>& a, const basic_vec3<T>& b) {
+    return basic_vec3<T>(b.e < a.e || a.e != a.e ? b.e : a.e);
 }
 
-inline vec3 vec_max(const vec3& a, const vec3& b) {
-    return vec3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+template <typename T>
+inline basic_vec3<T> vec_max(const basic_vec3<T>& a, const basic_vec3<T>& b) {
+    return basic_vec3<T>(b.e > a.e || a.e != a.e ? b.e : a.e);
 }
 
 inline vec3 rotate_point(const point3& p, const point3& origin, double angle, const vec3& axis) {
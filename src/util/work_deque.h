@@ -0,0 +1,107 @@
+#ifndef WORK_DEQUE_H
+#define WORK_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Lock-free double ended queue of pointers for work stealing (Chase and Lev 2005, with the memory
+// orderings of Le et al. 2013). One owner thread pushes and takes at the bottom, newest first, while
+// any number of other threads steal from the top, oldest first. The owner only touches the top when
+// the deque is down to its last item, so owner and thieves rarely contend.
+template <typename T>
+class work_deque {
+   public:
+    work_deque() : array(new ring(INITIAL_CAPACITY)) { retired.emplace_back(array.load()); }
+
+    work_deque(const work_deque&) = delete;
+    work_deque& operator=(const work_deque&) = delete;
+
+    // Owner only
+    void push(T* item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        ring* a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1)
+            a = grow(a, t, b);
+        a->put(b, item);
+        bottom.store(b + 1, std::memory_order_release);  // Publishes the item to thieves
+    }
+
+    // Owner only. Newest item, or nullptr if the deque is empty.
+    T* take() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        ring* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {  // Already empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T* item = a->get(b);
+        if (t == b) {
+            // Last item, race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Oldest item, or nullptr if the deque is empty or another thread got it first.
+    T* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+
+        ring* a = array.load(std::memory_order_acquire);
+        T* item = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+    // A hint only, the deque may change right after
+    bool empty() const {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_relaxed);
+        return t >= b;
+    }
+
+   private:
+    static const int64_t INITIAL_CAPACITY = 256;
+
+    // Circular array indexed by the ever growing top and bottom counters
+    struct ring {
+        int64_t capacity;  // Power of two
+        std::unique_ptr<std::atomic<T*>[]> items;
+
+        explicit ring(int64_t capacity) : capacity(capacity), items(new std::atomic<T*>[capacity]) {}
+
+        T* get(int64_t i) const { return items[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T* item) { items[i & (capacity - 1)].store(item, std::memory_order_relaxed); }
+    };
+
+    // Separate cache lines so the owner's bottom and the thieves' top don't false share
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    alignas(64) std::atomic<ring*> array;
+    std::vector<std::unique_ptr<ring>> retired;  // Every ring ever used, since a thief may still be reading an old one
+
+    ring* grow(ring* old, int64_t t, int64_t b) {
+        ring* bigger = new ring(old->capacity * 2);
+        for (int64_t i = t; i < b; i++)
+            bigger->put(i, old->get(i));
+        retired.emplace_back(bigger);
+        array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+};
+
+#endif